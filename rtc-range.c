@@ -5,99 +5,146 @@
  * Copyright (c) 2018 Alexandre Belloni <alexandre.belloni@bootlin.com>
  */
 
+#define _GNU_SOURCE
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <linux/rtc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/utsname.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "rtc-snapshot.h"
+
 static char *rtc_file = "/dev/rtc0";
+static int tick_detect;
+static int discover;
+static int alarm_test;
+static int stats;
+static char *cache_file;
+static int incremental;
 
-#define IOCTL(f, r, d, rc) rc = ioctl(f, r, d); \
+#define IOCTL(dev, r, d, rc) rc = rtc_ioctl(dev, r, d); \
 if (rc) { \
-	fprintf(stderr, "KO %s returned %d (line %d)\n", #r, errno, __LINE__); \
-	continue; \
+	rc = -errno; \
+	fprintf(stderr, "%sKO %s returned %d (line %d)\n", dev->prefix, #r, \
+		-rc, __LINE__); \
+	return rc; \
 }
 
 #define ISODATEFMT "%04d-%02d-%02d %02d:%02d:%02d"
 #define ISODATE(tm)  tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, \
 		       tm.tm_hour, tm.tm_min, tm.tm_sec
 
+#define NSEC_PER_SEC	1000000000LL
+#define NSEC_PER_MSEC	1000000LL
+
+/* Give up waiting for a tick after that long */
+#define TICK_TIMEOUT_MS	1500
+/* Interval between two reads when polling for a tick */
+#define TICK_POLL_NS	(5 * NSEC_PER_MSEC)
+/* Give up waiting for an alarm after that long past its due time */
+#define ALARM_TIMEOUT_MS	1500
+/* Sets done at different phases of the second to tell if the divider is reset */
+#define TICK_PHASES	3
+/* Delays of the tick after set spread wider than that mean it is not reset */
+#define TICK_SPREAD_NS	(200 * NSEC_PER_MSEC)
+/* How long before the next tick the time is set when the divider runs free */
+#define EDGE_LEAD_NS	(50 * NSEC_PER_MSEC)
+
+#define SECS_PER_DAY	86400LL
+
+/* Bounds of the range discovery: 1900-01-01 00:00:00 to 9999-12-31 23:59:59 */
+#define DISCOVER_MIN	-2208988800LL
+#define DISCOVER_MAX	253402300799LL
+/* Years accepted by --years, up to the end of the discovery range */
+#define YEAR_MIN	0
+#define YEAR_MAX	9999
+/* Start of the discovery when the RTC time is unknown: 2000-01-01 00:00:00 */
+#define DISCOVER_SEED	946684800LL
+
 #ifndef ARRAY_SIZE
 # define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 #endif
 
-static struct {
+#ifndef RTC_PARAM_GET
+struct rtc_param {
+	__u64 param;
+	union {
+		__u64 uvalue;
+		__s64 svalue;
+		__u64 ptr;
+	};
+	__u32 index;
+	__u32 __pad;
+};
+
+#define RTC_PARAM_GET	_IOW('p', 0x13, struct rtc_param)  /* Get parameter */
+
+#define RTC_FEATURE_ALARM_RES_MINUTE	1
+#define RTC_FEATURE_ALARM_RES_2S	3
+
+#define RTC_PARAM_FEATURES		0
+#endif
+
+#ifndef RTC_FEATURE_ALARM
+#define RTC_FEATURE_ALARM		0
+#define RTC_FEATURE_UPDATE_INTERRUPT	4
+#endif
+
+/* Default cases, each one is expected to roll over to the next second */
+static const struct rtc_time dates[] = {
+	/* UNIX epoch */
+	{ .tm_year = 70, .tm_mon = 0, .tm_mday = 1,
+	  .tm_hour = 0, .tm_min = 0, .tm_sec = 0 },
+	/* 2000 is a leap year */
+	{ .tm_year = 100, .tm_mon = 1, .tm_mday = 28,
+	  .tm_hour = 23, .tm_min = 59, .tm_sec = 59 },
+	/* 2020 is a leap year */
+	{ .tm_year = 120, .tm_mon = 1, .tm_mday = 28,
+	  .tm_hour = 23, .tm_min = 59, .tm_sec = 59 },
+	/* signed 32bit time_t overflow */
+	{ .tm_year = 138, .tm_mday = 19,
+	  .tm_hour = 3, .tm_min = 14, .tm_sec = 7 },
+	/* 2069 to 2070 */
+	{ .tm_year = 169, .tm_mon = 11, .tm_mday = 31,
+	  .tm_hour = 23, .tm_min = 59, .tm_sec = 59 },
+	/* 2079 to 2080 */
+	{ .tm_year = 179, .tm_mon = 11, .tm_mday = 31,
+	  .tm_hour = 23, .tm_min = 59, .tm_sec = 59 },
+	/* 2099 to 2100 */
+	{ .tm_year = 199, .tm_mon = 11, .tm_mday = 31,
+	  .tm_hour = 23, .tm_min = 59, .tm_sec = 59 },
+	/* 2100 is not a leap year */
+	{ .tm_year = 200, .tm_mon = 1, .tm_mday = 28,
+	  .tm_hour = 23, .tm_min = 59, .tm_sec = 59 },
+	/* unsigned 32bit time_t overflow */
+	{ .tm_year = 206, .tm_mon = 1, .tm_mday = 7,
+	  .tm_hour = 6, .tm_min = 28, .tm_sec = 15 },
+	/* ktime_t overflow */
+	{ .tm_year = 362, .tm_mon = 3, .tm_mday = 11,
+	  .tm_hour = 23, .tm_min = 47, .tm_sec = 16 },
+};
+
+struct rtc_case {
 	struct rtc_time tm;
 	struct rtc_time expected;
-} dates [] = {
-	{ /* UNIX epoch */
-		.tm = { .tm_year = 70, .tm_mon = 0, .tm_mday = 1,
-			.tm_hour = 0, .tm_min = 0, .tm_sec = 0 },
-		.expected = { .tm_year = 70, .tm_mon = 0, .tm_mday = 1,
-			      .tm_hour = 0, .tm_min = 0, .tm_sec = 1 }
-	},
-	{ /* 2000 is a leap year */
-		.tm = { .tm_year = 100, .tm_mon = 1, .tm_mday = 28,
-			.tm_hour = 23, .tm_min = 59, .tm_sec = 59 },
-		.expected = { .tm_year = 100, .tm_mon = 1, .tm_mday = 29,
-			      .tm_hour = 0, .tm_min = 0, .tm_sec = 0 }
-	},
-	{ /* 2020 is a leap year */
-		.tm = { .tm_year = 120, .tm_mon = 1, .tm_mday = 28,
-			.tm_hour = 23, .tm_min = 59, .tm_sec = 59 },
-		.expected = { .tm_year = 120, .tm_mon = 1, .tm_mday = 29,
-			      .tm_hour = 0, .tm_min = 0, .tm_sec = 0 }
-	},
-	{ /* signed 32bit time_t overflow */
-		.tm = { .tm_year = 138, .tm_mday = 19,
-			.tm_hour = 3, .tm_min = 14, .tm_sec = 7 },
-		.expected = { .tm_year = 138, .tm_mday = 19,
-			      .tm_hour = 3, .tm_min = 14, .tm_sec = 8 }
-	},
-	{ /* 2069 to 2070 */
-		.tm = { .tm_year = 169, .tm_mon = 11, .tm_mday = 31,
-			.tm_hour = 23, .tm_min = 59, .tm_sec = 59 },
-		.expected = { .tm_year = 170, .tm_mday = 1,
-			      .tm_hour = 0, .tm_min = 0, .tm_sec = 0 }
-	},
-	{ /* 2079 to 2080 */
-		.tm = { .tm_year = 179, .tm_mon = 11, .tm_mday = 31,
-			.tm_hour = 23, .tm_min = 59, .tm_sec = 59 },
-		.expected = { .tm_year = 180, .tm_mday = 1,
-			      .tm_hour = 0, .tm_min = 0, .tm_sec = 0 }
-	},
-	{ /* 2099 to 2100 */
-		.tm = { .tm_year = 199, .tm_mon = 11, .tm_mday = 31,
-			.tm_hour = 23, .tm_min = 59, .tm_sec = 59 },
-		.expected = { .tm_year = 200, .tm_mday = 1,
-			      .tm_hour = 0, .tm_min = 0, .tm_sec = 0 }
-	},
-	{ /* 2100 is not a leap year */
-		.tm = { .tm_year = 200, .tm_mon = 1, .tm_mday = 28,
-			.tm_hour = 23, .tm_min = 59, .tm_sec = 59 },
-		.expected = { .tm_year = 200, .tm_mon = 2, .tm_mday = 1,
-			      .tm_hour = 0, .tm_min = 0, .tm_sec = 0 }
-	},
-	{ /* unsigned 32bit time_t overflow */
-		.tm = { .tm_year = 206, .tm_mon = 1, .tm_mday = 7,
-			.tm_hour = 6, .tm_min = 28, .tm_sec = 15 },
-		.expected = { .tm_year = 206, .tm_mon = 1, .tm_mday = 7,
-			      .tm_hour = 6, .tm_min = 28, .tm_sec = 16 }
-	},
-	{ /* ktime_t overflow */
-		.tm = { .tm_year = 362, .tm_mon = 3, .tm_mday = 11,
-			.tm_hour = 23, .tm_min = 47, .tm_sec = 16 },
-		.expected = { .tm_year = 362, .tm_mon = 3, .tm_mday = 11,
-			      .tm_hour = 23, .tm_min = 47, .tm_sec = 17 }
-	},
 };
 
+static struct rtc_case *cases;
+static int ncases;
+
 static int compare_dates(struct rtc_time *a, struct rtc_time *b)
 {
 	if (a->tm_year != b->tm_year ||
@@ -111,78 +158,1339 @@ static int compare_dates(struct rtc_time *a, struct rtc_time *b)
 	return 0;
 }
 
-int main(int argc, char **argv)
+static int is_leap_year(long long year)
 {
-	int fd, i, rc;
+	return (!(year % 4) && (year % 100)) || !(year % 400);
+}
 
-	switch (argc) {
-	case 2:
-		rtc_file = argv[1];
-		/* FALLTHROUGH */
-	case 1:
-		break;
-	default:
-		fprintf(stderr, "usage: %s [rtcdev]\n", argv[0]);
-		return 1;
+/*
+ * Convert between seconds since the epoch and broken down time, using the
+ * proleptic Gregorian calendar. This doesn't depend on the size of time_t.
+ */
+static long long rtc_tm_to_time64(const struct rtc_time *tm)
+{
+	long long year = tm->tm_year + 1900LL;
+	unsigned int mon = tm->tm_mon + 1;
+	unsigned int yoe, doy, doe;
+	long long era;
+
+	/* Count from March so that February 29th is the last day of a year */
+	year -= mon <= 2;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + tm->tm_mday - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return (era * 146097 + doe - 719468) * SECS_PER_DAY +
+	       tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec;
+}
+
+static void rtc_time64_to_tm(long long time, struct rtc_time *tm)
+{
+	long long days = time / SECS_PER_DAY;
+	long long secs = time % SECS_PER_DAY;
+	unsigned int yoe, doy, doe, mp;
+	long long era, year;
+
+	if (secs < 0) {
+		secs += SECS_PER_DAY;
+		days--;
 	}
 
-	fd = open(rtc_file, O_RDONLY);
-	if (fd ==  -1) {
-		perror(rtc_file);
-		exit(errno);
+	tm->tm_wday = ((days + 4) % 7 + 7) % 7;
+
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	year = yoe + era * 400 + (mp >= 10);
+
+	tm->tm_year = year - 1900;
+	tm->tm_mon = mp < 10 ? mp + 2 : mp - 10;
+	tm->tm_mday = doy - (153 * mp + 2) / 5 + 1;
+	tm->tm_yday = mp < 10 ? doy + 59 + is_leap_year(year) : doy - 306;
+	tm->tm_hour = secs / 3600;
+	tm->tm_min = secs / 60 % 60;
+	tm->tm_sec = secs % 60;
+	tm->tm_isdst = 0;
+}
+
+static int add_case(long long time, long long expected)
+{
+	static int size;
+	struct rtc_case *c;
+
+	if (ncases == size) {
+		size = size ? size * 2 : 64;
+		c = realloc(cases, size * sizeof(*cases));
+		if (!c)
+			return -ENOMEM;
+		cases = c;
 	}
 
-	for (i = 0; i < ARRAY_SIZE(dates); i++) {
-		struct rtc_time tm;
+	rtc_time64_to_tm(time, &cases[ncases].tm);
+	rtc_time64_to_tm(expected, &cases[ncases].expected);
+	ncases++;
+
+	return 0;
+}
+
+static long long make_time64(int year, int mon, int mday,
+			     int hour, int min, int sec)
+{
+	struct rtc_time tm = {
+		.tm_year = year - 1900, .tm_mon = mon - 1, .tm_mday = mday,
+		.tm_hour = hour, .tm_min = min, .tm_sec = sec,
+	};
 
-		printf("\nTesting " ISODATEFMT ".\n", ISODATE(dates[i].tm));
+	return rtc_tm_to_time64(&tm);
+}
 
-		IOCTL(fd, RTC_SET_TIME, &dates[i].tm, rc);
+static int days_in_month(long long year, int mon)
+{
+	static const int mdays[] = { 31, 28, 31, 30, 31, 30,
+				     31, 31, 30, 31, 30, 31 };
 
-		IOCTL(fd, RTC_RD_TIME, &tm, rc);
+	return mdays[mon - 1] + (mon == 2 && is_leap_year(year));
+}
 
-		rc = compare_dates(&dates[i].tm, &tm);
-		if (rc) {
-			printf("KO  Read back " ISODATEFMT ".\n", ISODATE(tm));
+/*
+ * Generate the last second of every month between the first and last year,
+ * this includes every year and century rollover. February 28th is also added
+ * for leap years.
+ */
+static int generate_cases(int first, int last)
+{
+	long long time;
+	int year, mon, rc;
+
+	for (year = first; year <= last; year++) {
+		for (mon = 1; mon <= 12; mon++) {
+			if (mon == 2 && is_leap_year(year)) {
+				time = make_time64(year, 2, 28, 23, 59, 59);
+				rc = add_case(time, time + 1);
+				if (rc)
+					return rc;
+			}
+
+			time = make_time64(year, mon,
+					   days_in_month(year, mon),
+					   23, 59, 59);
+			rc = add_case(time, time + 1);
+			if (rc)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+static int parse_date(const char *str, long long *time, int *len)
+{
+	int year, mon, mday, hour, min, sec;
+
+	*len = 0;
+	if (sscanf(str, " %d-%d-%d%*[ T]%d:%d:%d%n", &year, &mon, &mday,
+		   &hour, &min, &sec, len) != 6 || !*len)
+		return -EINVAL;
+
+	if (mon < 1 || mon > 12 || mday < 1 ||
+	    mday > days_in_month(year, mon) ||
+	    hour < 0 || hour > 23 || min < 0 || min > 59 ||
+	    sec < 0 || sec > 59)
+		return -EINVAL;
+
+	*time = make_time64(year, mon, mday, hour, min, sec);
+
+	return 0;
+}
+
+/*
+ * Load cases from a file, one per line:
+ *   YYYY-MM-DD hh:mm:ss [YYYY-MM-DD hh:mm:ss]
+ * The second date is the expected time after a second, it defaults to the
+ * next second. Empty lines and lines starting with # are ignored.
+ */
+static int load_cases(const char *file)
+{
+	long long time, expected;
+	char line[128], *p;
+	int rc = 0, len, n = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || !*p)
 			continue;
+
+		rc = parse_date(p, &time, &len);
+		if (rc)
+			goto err;
+
+		p += len;
+		expected = time + 1;
+		if (p[strspn(p, " \t\n")]) {
+			rc = parse_date(p, &expected, &len);
+			if (rc)
+				goto err;
+
+			p += len;
+			if (p[strspn(p, " \t\n")]) {
+				rc = -EINVAL;
+				goto err;
+			}
+		}
+
+		rc = add_case(time, expected);
+		if (rc)
+			break;
+	}
+
+	fclose(f);
+
+	return rc;
+
+err:
+	fprintf(stderr, "%s:%d: invalid date\n", file, n);
+	fclose(f);
+
+	return rc;
+}
+
+static long long elapsed_ns(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * NSEC_PER_SEC +
+	       now.tv_nsec - start->tv_nsec;
+}
+
+struct lat_stats {
+	long long *samples;
+	int n, size;
+};
+
+struct rtc_dev {
+	char *name;
+	char prefix[64];
+	pthread_t thread;
+	int fd;
+	/* Per case result: 0 not run, 1 passed, -1 failed */
+	signed char *results;
+	int failures;
+	int probes;
+	/* Last tick seen and whether setting the time keeps its phase */
+	struct timespec edge;
+	int free_running;
+	/* Bracket of the last tick seen by wait_tick */
+	struct timespec tick_lo, tick_hi;
+	/* Tick after set delays of the sets done at TICK_PHASES phases */
+	int phases;
+	long long tick_min, tick_max;
+	/* Identifies the device, driver and kernel in the result cache */
+	uint64_t key;
+	/* Latencies in ns, only recorded with --stats */
+	struct lat_stats set_lat, rd_lat, tick_lat;
+	/* Known from the rtc info snapshot not to be supported */
+	int no_alarm, no_uie;
+	/* Resolution of the alarm in s */
+	int alarm_res;
+};
+
+static struct rtc_dev *devs;
+static int ndevs;
+
+/* Print a single line, tagged with the device name when testing several */
+#define report(dev, fmt, ...) printf("%s" fmt, (dev)->prefix, ##__VA_ARGS__)
+
+static int alarm_tested(struct rtc_dev *dev)
+{
+	return alarm_test && !dev->no_alarm;
+}
+
+static void add_sample(struct lat_stats *lat, long long ns)
+{
+	long long *samples;
+
+	if (lat->n == lat->size) {
+		lat->size = lat->size ? lat->size * 2 : 64;
+		samples = realloc(lat->samples, lat->size * sizeof(*samples));
+		if (!samples) {
+			perror("realloc");
+			exit(ENOMEM);
+		}
+		lat->samples = samples;
+	}
+
+	lat->samples[lat->n++] = ns;
+}
+
+/* ioctl() recording the latency of RTC_SET_TIME and RTC_RD_TIME */
+static int rtc_ioctl(struct rtc_dev *dev, unsigned long req, void *arg)
+{
+	struct timespec start;
+	long long ns;
+	int rc;
+
+	if (!stats || (req != RTC_SET_TIME && req != RTC_RD_TIME))
+		return ioctl(dev->fd, req, arg);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = ioctl(dev->fd, req, arg);
+	ns = elapsed_ns(&start);
+
+	if (!rc)
+		add_sample(req == RTC_SET_TIME ? &dev->set_lat : &dev->rd_lat,
+			   ns);
+
+	return rc;
+}
+
+/*
+ * Wait for the RTC to tick over from tm and return the new time in tm.
+ * Update interrupts are tried first but as they are implemented using alarms,
+ * they may not be available or may never fire. In that case, fall back to
+ * polling the time until it changes or TICK_TIMEOUT_MS expires. Polling is
+ * also used when use_uie is not set.
+ * The time elapsed since start is returned in delay. When polling, the tick
+ * is bracketed in tick_lo and tick_hi by the start of the last read still
+ * showing tm and the end of the first one past it.
+ * An update interrupt that never fires disables them for the device. As the
+ * tick may have come while waiting for it, it can't be timed: the time is
+ * read once and -ETIMEDOUT is returned, with errno set, as when the time
+ * didn't change while polling. tm then holds the last time read.
+ */
+static int wait_tick(struct rtc_dev *dev, struct rtc_time *tm, struct timespec *start,
+		     long long *delay, const char **method, int use_uie)
+{
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+	struct timespec interval = { .tv_nsec = TICK_POLL_NS };
+	struct timespec before, polling;
+	struct rtc_time cur;
+	unsigned long data;
+	int rc;
+
+	dev->tick_lo = *start;
+
+	if (use_uie && !dev->no_uie && !ioctl(dev->fd, RTC_UIE_ON, 0)) {
+		rc = poll(&pfd, 1, TICK_TIMEOUT_MS);
+		if (rc > 0)
+			rc = read(dev->fd, &data, sizeof(data));
+		*delay = elapsed_ns(start);
+		clock_gettime(CLOCK_MONOTONIC, &dev->tick_hi);
+		ioctl(dev->fd, RTC_UIE_OFF, 0);
+
+		if (rc > 0) {
+			*method = "uie";
+			return rtc_ioctl(dev, RTC_RD_TIME, tm);
+		}
+		if (!rc) {
+			dev->no_uie = 1;
+			rc = rtc_ioctl(dev, RTC_RD_TIME, tm);
+			if (rc)
+				return rc;
+			errno = ETIMEDOUT;
+			return -ETIMEDOUT;
+		}
+	}
+
+	*method = "poll";
+	clock_gettime(CLOCK_MONOTONIC, &polling);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		rc = rtc_ioctl(dev, RTC_RD_TIME, &cur);
+		*delay = elapsed_ns(start);
+		clock_gettime(CLOCK_MONOTONIC, &dev->tick_hi);
+		if (rc)
+			return rc;
+
+		if (cur.tm_sec != tm->tm_sec)
+			break;
+
+		dev->tick_lo = before;
+
+		if (elapsed_ns(&polling) >= TICK_TIMEOUT_MS * NSEC_PER_MSEC) {
+			*tm = cur;
+			errno = ETIMEDOUT;
+			return -ETIMEDOUT;
 		}
 
+		nanosleep(&interval, NULL);
+	}
+
+	*tm = cur;
+
+	return 0;
+}
+
+/* Sleep until the next instant phase ns after a tick */
+static void wait_phase(struct rtc_dev *dev, long long phase)
+{
+	struct timespec target = dev->edge;
+	long long ns = elapsed_ns(&dev->edge);
+	long long secs = ns / NSEC_PER_SEC;
+
+	if (secs * NSEC_PER_SEC + phase <= ns)
+		secs++;
+
+	ns = target.tv_nsec + secs * NSEC_PER_SEC + phase;
+	target.tv_sec += ns / NSEC_PER_SEC;
+	target.tv_nsec = ns % NSEC_PER_SEC;
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL);
+}
+
+/*
+ * When setting the time doesn't reset the RTC divider, the seconds keep
+ * ticking over at the same phase. Setting the time right before the next tick
+ * then checks the rollover a few milliseconds after the set. The cases still
+ * follow the tick though: each one waits for the next edge, so a device runs
+ * about one case per second whether the divider is reset or not.
+ */
+static void wait_before_edge(struct rtc_dev *dev)
+{
+	wait_phase(dev, NSEC_PER_SEC - EDGE_LEAD_NS);
+}
+
+/*
+ * Whether the divider is reset can't be told from a single set: some RTCs,
+ * like the mc146818, tick half a second after it. The first sets are done at
+ * different phases of the second instead. When the divider is reset, the
+ * tick comes at the same delay after each of them, otherwise the delays
+ * follow the phase.
+ */
+static void add_phase(struct rtc_dev *dev, long long delay)
+{
+	if (!dev->phases || delay < dev->tick_min)
+		dev->tick_min = delay;
+	if (!dev->phases || delay > dev->tick_max)
+		dev->tick_max = delay;
+
+	if (++dev->phases == TICK_PHASES)
+		dev->free_running = dev->tick_max - dev->tick_min >
+				    TICK_SPREAD_NS;
+}
+
+/* Resolution of the alarm in s, as advertised in the RTC features */
+static int alarm_resolution(struct rtc_dev *dev)
+{
+	struct rtc_param param = { .param = RTC_PARAM_FEATURES };
+
+	if (ioctl(dev->fd, RTC_PARAM_GET, &param) < 0)
+		return 1;
+
+	if (param.uvalue & (1ULL << RTC_FEATURE_ALARM_RES_MINUTE))
+		return 60;
+	if (param.uvalue & (1ULL << RTC_FEATURE_ALARM_RES_2S))
+		return 2;
+
+	return 1;
+}
+
+/*
+ * Check the alarm can be programmed one second after the expected date, or
+ * on the next multiple of its resolution, that it reads back and that it
+ * fires in time.
+ * Note: this will always fail the ktime_t overflow because alarms are stored
+ * internally in a ktime_t.
+ */
+static int test_alarm(struct rtc_dev *dev, int i)
+{
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+	struct rtc_wkalrm alm = { .enabled = 1 };
+	struct timespec start, edge;
+	const char *method;
+	long long delay, late, width, expected, due;
+	struct rtc_time tm;
+	unsigned long data;
+	int fd = dev->fd;
+	int rc;
+
+	IOCTL(dev, RTC_SET_TIME, &cases[i].tm, rc);
+
+	/* Find the tick so the alarm lateness can be measured from it */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tm = cases[i].tm;
+	rc = wait_tick(dev, &tm, &start, &delay, &method, 0);
+	if (rc == -ETIMEDOUT) {
+		report(dev, "KO ALM No tick after %d ms\n", TICK_TIMEOUT_MS);
+		return 1;
+	} else if (rc) {
+		rc = -errno;
+		fprintf(stderr, "%sKO RTC_RD_TIME returned %d (line %d)\n",
+			dev->prefix, -rc, __LINE__);
+		return rc;
+	}
+
+	/* Measure from the middle of the bracket of the tick */
+	width = (dev->tick_hi.tv_sec - dev->tick_lo.tv_sec) * NSEC_PER_SEC +
+		dev->tick_hi.tv_nsec - dev->tick_lo.tv_nsec;
+	delay = dev->tick_lo.tv_nsec + width / 2;
+	edge.tv_sec = dev->tick_lo.tv_sec + delay / NSEC_PER_SEC;
+	edge.tv_nsec = delay % NSEC_PER_SEC;
+
+	/* The tick rolled over to the expected date */
+	expected = rtc_tm_to_time64(&cases[i].expected);
+	due = expected + 1;
+	due += (dev->alarm_res - due % dev->alarm_res) % dev->alarm_res;
+	rtc_time64_to_tm(due, &alm.time);
+	due = (due - expected) * NSEC_PER_SEC;
+	IOCTL(dev, RTC_WKALM_SET, &alm, rc);
+
+	memset(&alm, 0, sizeof(alm));
+	rc = ioctl(fd, RTC_WKALM_RD, &alm);
+	if (rc) {
+		rc = -errno;
+		fprintf(stderr, "%sKO RTC_WKALM_RD returned %d (line %d)\n",
+			dev->prefix, -rc, __LINE__);
+		goto out;
+	}
+
+	rtc_time64_to_tm(expected + due / NSEC_PER_SEC, &tm);
+	if (compare_dates(&alm.time, &tm) || !alm.enabled) {
+		report(dev, "KO ALM Read back " ISODATEFMT "%s.\n",
+		       ISODATE(alm.time), alm.enabled ? "" : " (disabled)");
+		rc = 1;
+		goto out;
+	}
+
+	delay = due + ALARM_TIMEOUT_MS * NSEC_PER_MSEC - elapsed_ns(&edge);
+	rc = poll(&pfd, 1, delay > 0 ? delay / NSEC_PER_MSEC : 0);
+	late = elapsed_ns(&edge) - due;
+	if (rc < 0) {
+		rc = -errno;
+		perror("poll");
+		goto out;
+	}
+	if (!rc) {
+		report(dev, "KO ALM Not fired after %lld ms\n",
+		       due / NSEC_PER_MSEC + ALARM_TIMEOUT_MS);
+		rc = 1;
+		goto out;
+	}
+
+	rc = read(fd, &data, sizeof(data));
+	if (rc < 0) {
+		rc = -errno;
+		perror("read");
+		goto out;
+	}
+
+	if (!(data & RTC_AF)) {
+		report(dev, "KO ALM Unexpected interrupt 0x%lx\n", data & 0xff);
+		rc = 1;
+		goto out;
+	}
+
+	report(dev, "OK  ALM fired %s%lld.%03lld ms late (+/- %lld.%03lld ms)\n",
+	       late < 0 ? "-" : "", llabs(late) / NSEC_PER_MSEC,
+	       llabs(late) % NSEC_PER_MSEC / 1000, width / 2 / NSEC_PER_MSEC,
+	       width / 2 % NSEC_PER_MSEC / 1000);
+	rc = 0;
+
+out:
+	ioctl(fd, RTC_AIE_OFF, 0);
+
+	return rc;
+}
+
+/*
+ * Set the RTC to the date and check it rolls over to the expected date.
+ * Returns 0 on success, 1 on a mismatch and a negative error code when the
+ * driver rejected an operation.
+ */
+static int test_date(struct rtc_dev *dev, int i)
+{
+	struct timespec start;
+	const char *method;
+	struct rtc_time tm;
+	long long delay;
+	int ticked = 0, aimed = 0;
+	int rc;
+
+	if (ndevs == 1)
+		printf("\n");
+	report(dev, "Testing " ISODATEFMT ".\n", ISODATE(cases[i].tm));
+
+	if (tick_detect && dev->free_running) {
+		wait_before_edge(dev);
+		aimed = 1;
+	}
+	else if (tick_detect && dev->phases && dev->phases < TICK_PHASES)
+		wait_phase(dev, dev->phases * NSEC_PER_SEC / TICK_PHASES);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	IOCTL(dev, RTC_SET_TIME, &cases[i].tm, rc);
+
+	IOCTL(dev, RTC_RD_TIME, &tm, rc);
+
+	rc = compare_dates(&cases[i].tm, &tm);
+	if (rc && dev->free_running &&
+	    !compare_dates(&cases[i].expected, &tm)) {
+		/* Set right before the tick, it happened while reading back */
+		delay = elapsed_ns(&start);
+		method = "readback";
+		ticked = 1;
+	} else if (rc) {
+		report(dev, "KO  Read back " ISODATEFMT ".\n", ISODATE(tm));
+		return 1;
+	} else if (tick_detect) {
+		/*
+		 * Update interrupts would race with a tick right after the
+		 * set, only poll when aiming for the edge.
+		 */
+		rc = wait_tick(dev, &tm, &start, &delay, &method,
+			       !dev->free_running);
+		/*
+		 * A missed tick shows up as the time not rolling over, one
+		 * that came while waiting for a lost update interrupt still
+		 * checks the rollover but isn't timed.
+		 */
+		if (!rc) {
+			ticked = 1;
+		} else if (rc != -ETIMEDOUT) {
+			rc = -errno;
+			fprintf(stderr, "%sKO RTC_RD_TIME returned %d (line %d)\n",
+				dev->prefix, -rc, __LINE__);
+			return rc;
+		}
+	} else {
 		/*
-		 * We can't rely on alarms to work and because update interrupts
-		 * are implemented using alarms, they are not usable either
+		 * We can't rely on alarms to work and because update
+		 * interrupts are implemented using alarms, they are not
+		 * usable either
 		 */
 		sleep(1);
 
-		IOCTL(fd, RTC_RD_TIME, &tm, rc);
+		IOCTL(dev, RTC_RD_TIME, &tm, rc);
+	}
 
-		rc = compare_dates(&dates[i].expected, &tm);
-		if (rc) {
-			printf("KO  Expected " ISODATEFMT ".\n",
-			       ISODATE(dates[i].expected));
-			printf("    Got      " ISODATEFMT ".\n", ISODATE(tm));
+	/*
+	 * Only a tick actually seen tells the phase and latency. When aiming
+	 * for the edge, the delay is set by EDGE_LEAD_NS and says nothing
+	 * about the RTC.
+	 */
+	if (ticked) {
+		clock_gettime(CLOCK_MONOTONIC, &dev->edge);
+		if (dev->phases < TICK_PHASES)
+			add_phase(dev, delay);
+		if (stats && !aimed)
+			add_sample(&dev->tick_lat, delay);
+	}
+
+	rc = compare_dates(&cases[i].expected, &tm);
+	if (rc) {
+		report(dev, "KO  Expected " ISODATEFMT ".\n",
+		       ISODATE(cases[i].expected));
+		report(dev, "    Got      " ISODATEFMT ".\n", ISODATE(tm));
+		return 1;
+	}
+
+	if (ticked)
+		report(dev, "OK  Tick after %lld.%03lld ms (%s)\n",
+		       delay / NSEC_PER_MSEC, delay % NSEC_PER_MSEC / 1000,
+		       method);
+	else if (tick_detect)
+		report(dev, "OK  Tick not timed\n");
+	else
+		report(dev, "OK\n");
+
+	if (alarm_tested(dev))
+		return test_alarm(dev, i);
+
+	return 0;
+}
+
+/*
+ * The result cache is a header followed by fixed size records in host byte
+ * order. Records are appended as soon as a case completes so an interrupted
+ * run can be resumed, the last record for a case wins.
+ */
+#define CACHE_MAGIC	0x52435452	/* "RTCR" */
+#define CACHE_VERSION	1
+
+/* Flags of a cache record */
+#define CACHE_ALARM	(1 << 0)	/* the alarm was also tested */
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct cache_record {
+	uint64_t key;
+	int64_t time;
+	int64_t expected;
+	uint32_t flags;
+	int32_t result;
+};
+
+static struct cache_record *cache;
+static size_t cache_len;
+static FILE *cache_out;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A record along with its position in the file while loading the cache */
+struct cache_entry {
+	struct cache_record rec;
+	size_t seq;
+};
+
+static int compare_record(const void *a, const void *b)
+{
+	const struct cache_record *x = a, *y = b;
+
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	if (x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+	if (x->expected != y->expected)
+		return x->expected < y->expected ? -1 : 1;
+
+	return 0;
+}
+
+/* Sort the records of the same case from the latest to the oldest */
+static int compare_entry(const void *a, const void *b)
+{
+	const struct cache_entry *x = a, *y = b;
+	int rc = compare_record(&x->rec, &y->rec);
+
+	if (rc)
+		return rc;
+
+	return x->seq > y->seq ? -1 : x->seq < y->seq;
+}
+
+static uint64_t fnv1a(uint64_t hash, const char *str)
+{
+	/* Include the terminating NUL so that fields can't run into each other */
+	do {
+		hash ^= (unsigned char)*str;
+		hash *= 0x100000001b3ULL;
+	} while (*str++);
+
+	return hash;
+}
+
+/* Hash the device name, the driver name and the kernel release */
+static uint64_t cache_key(const char *name)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	char real[PATH_MAX], path[PATH_MAX + 32], driver[64] = "";
+	struct utsname uts;
+	const char *dev;
+	FILE *f;
+
+	/* dev points into real, the sysfs path is built in its own buffer */
+	if (realpath(name, real))
+		name = real;
+	dev = basename(name);
+	hash = fnv1a(hash, dev);
+
+	snprintf(path, sizeof(path), "/sys/class/rtc/%s/name", dev);
+	f = fopen(path, "r");
+	if (f) {
+		if (fgets(driver, sizeof(driver), f))
+			driver[strcspn(driver, "\n")] = '\0';
+		fclose(f);
+	}
+	hash = fnv1a(hash, driver);
+
+	if (!uname(&uts))
+		hash = fnv1a(hash, uts.release);
+
+	return hash;
+}
+
+/*
+ * Load the cache, keeping only the last record of each case, then rewrite it
+ * compacted and keep it open to append the new results.
+ */
+static int open_cache(const char *file)
+{
+	struct cache_header hdr = { CACHE_MAGIC, CACHE_VERSION };
+	struct cache_entry *entries = NULL, *e;
+	struct cache_record rec;
+	size_t i, len, n = 0, size = 0;
+	char *tmp;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (f) {
+		/* Only an empty file may be overwritten, it could be another's */
+		len = fread(&hdr, 1, sizeof(hdr), f);
+		if (len && (len != sizeof(hdr) || hdr.magic != CACHE_MAGIC ||
+			    hdr.version != CACHE_VERSION)) {
+			fprintf(stderr, "%s: unsupported cache, not overwriting it\n",
+				file);
+			fclose(f);
+			return -EINVAL;
+		}
+
+		while (fread(&rec, sizeof(rec), 1, f) == 1) {
+			if (n == size) {
+				size = size ? size * 2 : 256;
+				e = realloc(entries, size * sizeof(*e));
+				if (!e) {
+					free(entries);
+					fclose(f);
+					return -ENOMEM;
+				}
+				entries = e;
+			}
+			entries[n].rec = rec;
+			entries[n].seq = n;
+			n++;
+		}
+		fclose(f);
+	} else if (errno != ENOENT) {
+		return -errno;
+	}
+
+	qsort(entries, n, sizeof(*entries), compare_entry);
+
+	cache = calloc(n ? n : 1, sizeof(*cache));
+	if (!cache) {
+		free(entries);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < n; i++)
+		if (!cache_len ||
+		    compare_record(&cache[cache_len - 1], &entries[i].rec))
+			cache[cache_len++] = entries[i].rec;
+	free(entries);
+
+	if (asprintf(&tmp, "%s.tmp", file) < 0)
+		return -ENOMEM;
+
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	cache_out = fopen(tmp, "w");
+	if (!cache_out ||
+	    fwrite(&hdr, sizeof(hdr), 1, cache_out) != 1 ||
+	    fwrite(cache, sizeof(*cache), cache_len, cache_out) != cache_len ||
+	    fflush(cache_out) || rename(tmp, file)) {
+		int err = errno;
+
+		if (cache_out)
+			fclose(cache_out);
+		cache_out = NULL;
+		unlink(tmp);
+		free(tmp);
+		return -err;
+	}
+	free(tmp);
+
+	return 0;
+}
+
+static int cache_passed(struct rtc_dev *dev, int i)
+{
+	struct cache_record *rec, key = {
+		.key = dev->key,
+		.time = rtc_tm_to_time64(&cases[i].tm),
+		.expected = rtc_tm_to_time64(&cases[i].expected),
+	};
+	uint32_t flags = alarm_tested(dev) ? CACHE_ALARM : 0;
+
+	rec = bsearch(&key, cache, cache_len, sizeof(*cache), compare_record);
+
+	return rec && !rec->result && (rec->flags & flags) == flags;
+}
+
+static void cache_store(struct rtc_dev *dev, int i, int result)
+{
+	struct cache_record rec = {
+		.key = dev->key,
+		.time = rtc_tm_to_time64(&cases[i].tm),
+		.expected = rtc_tm_to_time64(&cases[i].expected),
+		.flags = alarm_tested(dev) ? CACHE_ALARM : 0,
+		.result = result,
+	};
+
+	pthread_mutex_lock(&cache_lock);
+	if (fwrite(&rec, sizeof(rec), 1, cache_out) != 1 || fflush(cache_out))
+		perror(cache_file);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void *test_dev(void *arg)
+{
+	struct rtc_dev *dev = arg;
+	int i, rc;
+
+	for (i = 0; i < ncases; i++) {
+		if (incremental && cache_passed(dev, i)) {
+			report(dev, "Cached OK " ISODATEFMT ".\n",
+			       ISODATE(cases[i].tm));
+			dev->results[i] = 1;
 			continue;
 		}
 
-		printf("OK\n");
-		continue;
+		rc = test_date(dev, i);
+		if (rc) {
+			dev->results[i] = -1;
+			dev->failures++;
+		} else {
+			dev->results[i] = 1;
+		}
 
-		/*
-		 * Test alarms note: this will always fail the ktime_t overflow
-		 * because it is stored internally in a ktime_t
-		 */
-		IOCTL(fd, RTC_SET_TIME, &dates[i].tm, rc);
+		if (cache_out)
+			cache_store(dev, i, rc);
+	}
+
+	return NULL;
+}
+
+/*
+ * Check whether the RTC holds the time. Reading back the next second is fine
+ * as it may have ticked in the meantime.
+ */
+static int probe_time(struct rtc_dev *dev, long long time)
+{
+	struct rtc_time tm;
+	long long got;
+
+	dev->probes++;
+
+	rtc_time64_to_tm(time, &tm);
+	if (rtc_ioctl(dev, RTC_SET_TIME, &tm) ||
+	    rtc_ioctl(dev, RTC_RD_TIME, &tm))
+		return 0;
+
+	got = rtc_tm_to_time64(&tm);
+
+	return got == time || got == time + 1;
+}
+
+/* Find the last time held by the RTC between good and bad */
+static long long bisect_time(struct rtc_dev *dev, long long good, long long bad)
+{
+	long long mid;
 
-		IOCTL(fd, RTC_WKALM_SET, &dates[i].tm, rc);
+	while (good - bad > 1 || bad - good > 1) {
+		mid = good + (bad - good) / 2;
+		if (probe_time(dev, mid))
+			good = mid;
+		else
+			bad = mid;
+	}
 
-		IOCTL(fd, RTC_WKALM_RD, &dates[i].tm, rc);
+	return good;
+}
 
-		rc = compare_dates(&dates[i].tm, &tm);
+/*
+ * Discover the range supported by the RTC. This assumes the supported range
+ * is contiguous and includes either the current RTC time or 2000-01-01.
+ * The RTC time is restored afterwards.
+ */
+static void *discover_dev(void *arg)
+{
+	struct rtc_dev *dev = arg;
+	struct rtc_time tm, min_tm, max_tm;
+	long long seed, min, max;
+	struct timespec start;
+	int restore;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	restore = !rtc_ioctl(dev, RTC_RD_TIME, &tm);
+	seed = restore ? rtc_tm_to_time64(&tm) : DISCOVER_SEED;
+
+	if (!probe_time(dev, seed)) {
+		seed = DISCOVER_SEED;
+		if (!probe_time(dev, seed)) {
+			report(dev, "KO  Unable to find a supported time\n");
+			dev->failures++;
+			return NULL;
+		}
+	}
+
+	min = probe_time(dev, DISCOVER_MIN) ? DISCOVER_MIN :
+	      bisect_time(dev, seed, DISCOVER_MIN);
+	max = probe_time(dev, DISCOVER_MAX) ? DISCOVER_MAX :
+	      bisect_time(dev, seed, DISCOVER_MAX);
+
+	rtc_time64_to_tm(min, &min_tm);
+	rtc_time64_to_tm(max, &max_tm);
+	report(dev, "Range " ISODATEFMT " to " ISODATEFMT " (%lld to %lld, %d probes)\n",
+	       ISODATE(min_tm), ISODATE(max_tm), min, max, dev->probes);
+
+	if (min == DISCOVER_MIN || max == DISCOVER_MAX)
+		report(dev, "    Range reaches the discovery bounds\n");
+
+	if (restore) {
+		rtc_time64_to_tm(rtc_tm_to_time64(&tm) +
+				 elapsed_ns(&start) / NSEC_PER_SEC, &tm);
+		if (rtc_ioctl(dev, RTC_SET_TIME, &tm))
+			fprintf(stderr, "%sKO RTC_SET_TIME returned %d (line %d)\n",
+				dev->prefix, errno, __LINE__);
+	}
+
+	return NULL;
+}
+
+static int is_rtc_dev(const struct dirent *d)
+{
+	const char *p;
+
+	if (strncmp(d->d_name, "rtc", 3) || !d->d_name[3])
+		return 0;
+
+	for (p = d->d_name + 3; *p; p++)
+		if (*p < '0' || *p > '9')
+			return 0;
+
+	return 1;
+}
+
+/* Find all the RTC character devices, in rtc0, rtc1, ..., rtc10 order */
+static int find_rtc_devs(char ***names)
+{
+	struct dirent **list;
+	char *name;
+	int i, n;
+
+	n = scandir("/dev", &list, is_rtc_dev, versionsort);
+	if (n < 0)
+		return -errno;
+
+	*names = calloc(n ? n : 1, sizeof(**names));
+	if (!*names)
+		goto err;
+
+	for (i = 0; i < n; i++) {
+		if (asprintf(&name, "/dev/%s", list[i]->d_name) < 0)
+			goto err;
+		(*names)[i] = name;
+	}
+
+	for (i = 0; i < n; i++)
+		free(list[i]);
+	free(list);
+
+	return n;
+
+err:
+	for (i = 0; i < n; i++) {
+		if (*names)
+			free((*names)[i]);
+		free(list[i]);
+	}
+	free(*names);
+	*names = NULL;
+	free(list);
+
+	return -ENOMEM;
+}
+
+static void print_matrix(void)
+{
+	int i, j;
+
+	printf("\n%-20s", "Date");
+	for (j = 0; j < ndevs; j++)
+		printf(" %-8s", basename(devs[j].name));
+	printf("\n");
+
+	for (i = 0; i < ncases; i++) {
+		printf(ISODATEFMT " ", ISODATE(cases[i].tm));
+		for (j = 0; j < ndevs; j++) {
+			switch (devs[j].results[i]) {
+			case 1:
+				printf(" %-8s", "OK");
+				break;
+			case -1:
+				printf(" %-8s", "KO");
+				break;
+			default:
+				printf(" %-8s", "--");
+			}
+		}
+		printf("\n");
+	}
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+#define MSEC(ns) (ns) / NSEC_PER_MSEC, (ns) % NSEC_PER_MSEC / 1000
+
+static void print_lat(struct rtc_dev *dev, const char *name,
+		      struct lat_stats *lat)
+{
+	long long *s = lat->samples;
+	int n = lat->n;
+
+	if (!n)
+		return;
+
+	qsort(s, n, sizeof(*s), compare_ll);
+
+	/* nearest rank percentiles */
+	printf("%s%-16s %6d  %5lld.%03lld  %5lld.%03lld  %5lld.%03lld  %5lld.%03lld\n",
+	       dev->prefix, name, n, MSEC(s[0]), MSEC(s[(n + 1) / 2 - 1]),
+	       MSEC(s[(99 * n + 99) / 100 - 1]), MSEC(s[n - 1]));
+}
+
+static void print_stats(struct rtc_dev *dev)
+{
+	printf("\n%s%-16s %6s  %9s  %9s  %9s  %9s\n", dev->prefix, "Latency (ms)",
+	       "count", "min", "median", "p99", "max");
+	print_lat(dev, "RTC_SET_TIME", &dev->set_lat);
+	print_lat(dev, "RTC_RD_TIME", &dev->rd_lat);
+	print_lat(dev, "tick after set", &dev->tick_lat);
+
+	if (dev->phases < TICK_PHASES)
+		return;
+
+	if (!dev->free_running)
+		printf("%sSetting the time resets the sub-second divider\n",
+		       dev->prefix);
+	else
+		printf("%sSetting the time keeps the sub-second divider running\n",
+		       dev->prefix);
+}
+
+static void usage(char *name)
+{
+	fprintf(stderr, "usage: %s [options] [rtcdev...]\n", name);
+	fprintf(stderr, "  -t, --tick      wait for the second to tick over instead of sleeping\n");
+	fprintf(stderr, "  -A, --all       test all the RTCs found in /dev in parallel\n");
+	fprintf(stderr, "  -a, --alarm     also check the alarm at each date\n");
+	fprintf(stderr, "  -s, --stats     report ioctl and tick latencies, implies --tick\n");
+	fprintf(stderr, "  -c, --cache FILE\n");
+	fprintf(stderr, "                  record the results in FILE\n");
+	fprintf(stderr, "  -i, --incremental\n");
+	fprintf(stderr, "                  skip the cases that passed for the same device,\n");
+	fprintf(stderr, "                  driver and kernel, requires --cache\n");
+	fprintf(stderr, "  -d, --discover  find the range supported by the RTC instead\n");
+	fprintf(stderr, "  -y, --years FIRST[:LAST]\n");
+	fprintf(stderr, "                  test every month end from FIRST to LAST,\n");
+	fprintf(stderr, "                  between %d and %d\n", YEAR_MIN, YEAR_MAX);
+	fprintf(stderr, "  -f, --file FILE\n");
+	fprintf(stderr, "                  test the dates listed in FILE\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "tick", no_argument, NULL, 't' },
+		{ "all", no_argument, NULL, 'A' },
+		{ "alarm", no_argument, NULL, 'a' },
+		{ "stats", no_argument, NULL, 's' },
+		{ "cache", required_argument, NULL, 'c' },
+		{ "incremental", no_argument, NULL, 'i' },
+		{ "discover", no_argument, NULL, 'd' },
+		{ "years", required_argument, NULL, 'y' },
+		{ "file", required_argument, NULL, 'f' },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0 }
+	};
+	char **names = &rtc_file;
+	struct rtc_snapshot snap;
+	int all = 0, failures = 0;
+	int i, rc, opt, first, last, len;
+
+	while ((opt = getopt_long(argc, argv, "tAasc:idy:f:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			tick_detect = 1;
+			break;
+		case 'A':
+			all = 1;
+			break;
+		case 'a':
+			alarm_test = 1;
+			break;
+		case 's':
+			stats = 1;
+			tick_detect = 1;
+			break;
+		case 'c':
+			cache_file = optarg;
+			break;
+		case 'i':
+			incremental = 1;
+			break;
+		case 'd':
+			discover = 1;
+			break;
+		case 'y':
+			/* The whole argument has to be consumed */
+			len = 0;
+			if (sscanf(optarg, "%d%n:%d%n", &first, &len, &last,
+				   &len) < 1 || optarg[len]) {
+				usage(argv[0]);
+				return 1;
+			}
+			if (!strchr(optarg, ':'))
+				last = first;
+			if (first < YEAR_MIN || last > YEAR_MAX ||
+			    first > last) {
+				usage(argv[0]);
+				return 1;
+			}
+
+			rc = generate_cases(first, last);
+			if (rc) {
+				fprintf(stderr, "%s\n", strerror(-rc));
+				exit(-rc);
+			}
+			break;
+		case 'f':
+			rc = load_cases(optarg);
+			if (rc) {
+				fprintf(stderr, "%s: %s\n", optarg, strerror(-rc));
+				exit(-rc);
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (incremental && !cache_file) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (cache_file && !discover) {
+		rc = open_cache(cache_file);
 		if (rc) {
-			printf("KO ALM Read back " ISODATEFMT ".\n",
-			       ISODATE(tm));
-			continue;
+			fprintf(stderr, "%s: %s\n", cache_file, strerror(-rc));
+			exit(-rc);
+		}
+	}
+
+	if (!ncases) {
+		for (i = 0; i < (int)ARRAY_SIZE(dates); i++) {
+			rc = add_case(rtc_tm_to_time64(&dates[i]),
+				      rtc_tm_to_time64(&dates[i]) + 1);
+			if (rc) {
+				fprintf(stderr, "%s\n", strerror(-rc));
+				exit(-rc);
+			}
 		}
 	}
 
-	close(fd);
+	if (all) {
+		if (optind != argc) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		ndevs = find_rtc_devs(&names);
+		if (ndevs < 0) {
+			fprintf(stderr, "/dev: %s\n", strerror(-ndevs));
+			exit(-ndevs);
+		}
+		if (!ndevs) {
+			fprintf(stderr, "No RTC found\n");
+			exit(ENODEV);
+		}
+	} else if (optind < argc) {
+		names = &argv[optind];
+		ndevs = argc - optind;
+	} else {
+		ndevs = 1;
+	}
+
+	devs = calloc(ndevs, sizeof(*devs));
+	if (!devs) {
+		perror("calloc");
+		exit(ENOMEM);
+	}
+
+	for (i = 0; i < ndevs; i++) {
+		devs[i].name = names[i];
+		devs[i].key = cache_key(names[i]);
+		if (ndevs > 1)
+			snprintf(devs[i].prefix, sizeof(devs[i].prefix), "%s: ",
+				 basename(names[i]));
+
+		devs[i].results = calloc(ncases,
+					 sizeof(*devs[i].results));
+		if (!devs[i].results) {
+			perror("calloc");
+			exit(ENOMEM);
+		}
+
+		devs[i].fd = open(devs[i].name, O_RDONLY);
+		if (devs[i].fd ==  -1) {
+			perror(devs[i].name);
+			exit(errno);
+		}
+
+		if (!rtc_snapshot_load(devs[i].name, &snap)) {
+			devs[i].no_alarm = rtc_snapshot_lacks(&snap,
+							      RTC_FEATURE_ALARM);
+			devs[i].no_uie = rtc_snapshot_lacks(&snap,
+							    RTC_FEATURE_UPDATE_INTERRUPT);
+		}
+		if (alarm_test && devs[i].no_alarm) {
+			report(&devs[i], "No alarm support, not testing it\n");
+		} else if (alarm_test) {
+			/*
+			 * Waiting for the next minute would make each case
+			 * last up to a minute
+			 */
+			devs[i].alarm_res = alarm_resolution(&devs[i]);
+			if (devs[i].alarm_res >= 60) {
+				report(&devs[i], "Alarm resolution is a minute, not testing it\n");
+				devs[i].no_alarm = 1;
+			}
+		}
+	}
+
+	if (ndevs == 1) {
+		if (discover)
+			discover_dev(&devs[0]);
+		else
+			test_dev(&devs[0]);
+	} else {
+		for (i = 0; i < ndevs; i++) {
+			rc = pthread_create(&devs[i].thread, NULL,
+					    discover ? discover_dev : test_dev,
+					    &devs[i]);
+			if (rc) {
+				fprintf(stderr, "pthread_create: %s\n",
+					strerror(rc));
+				exit(rc);
+			}
+		}
+
+		for (i = 0; i < ndevs; i++)
+			pthread_join(devs[i].thread, NULL);
+
+		if (!discover)
+			print_matrix();
+	}
+
+	for (i = 0; i < ndevs; i++) {
+		if (stats)
+			print_stats(&devs[i]);
+		failures += devs[i].failures;
+		close(devs[i].fd);
+	}
+
+	return failures ? 1 : 0;
 }
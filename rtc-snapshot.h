@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Capabilities and status of an RTC, as captured by rtc info
+ *
+ * The snapshot lets the tools skip what the RTC does not support instead of
+ * trying and learning it from the error:
+ *
+ *	struct rtc_snapshot snap;
+ *
+ *	if (!rtc_snapshot_load("/dev/rtc0", &snap) &&
+ *	    rtc_snapshot_lacks(&snap, RTC_FEATURE_ALARM))
+ *		... do not use the alarm ...
+ *
+ * A snapshot older than the device node is not loaded: the RTC was registered
+ * again since, possibly with another driver, and rtc info has to be run again.
+ */
+#ifndef RTC_SNAPSHOT_H
+#define RTC_SNAPSHOT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RTC_SNAPSHOT_DIR	"/run/rtc"
+#define RTC_SNAPSHOT_MAGIC	0x52544353	/* "RTCS" */
+#define RTC_SNAPSHOT_VERSION	1
+
+/* Parameters and indexes captured, RTC_PARAM_FEATURES is params[0][0] */
+#define RTC_SNAPSHOT_PARAMS	3
+#define RTC_SNAPSHOT_INDEXES	4
+
+struct rtc_snapshot_value {
+	int64_t value;
+	int32_t error;		/* errno of the ioctl, value is only valid at 0 */
+	uint32_t reserved;
+};
+
+struct rtc_snapshot {
+	uint32_t magic;
+	uint32_t version;
+	int64_t taken;		/* system time of the snapshot, in s */
+	struct rtc_snapshot_value params[RTC_SNAPSHOT_INDEXES][RTC_SNAPSHOT_PARAMS];
+	struct rtc_snapshot_value time;		/* RTC time, in s since the epoch */
+	struct rtc_snapshot_value alarm;	/* wakeup alarm, in s since the epoch */
+	struct rtc_snapshot_value vl;		/* RTC_VL_* flags */
+	uint32_t alarm_enabled;
+	uint32_t alarm_pending;
+};
+
+/* Path of the snapshot of the RTC device, e.g. "/dev/rtc0" */
+static inline void rtc_snapshot_path(char *path, size_t len, const char *rtc)
+{
+	char real[PATH_MAX];
+	const char *name;
+
+	if (realpath(rtc, real))
+		rtc = real;
+	name = strrchr(rtc, '/');
+
+	snprintf(path, len, "%s/%s", RTC_SNAPSHOT_DIR, name ? name + 1 : rtc);
+}
+
+/*
+ * Load the snapshot of the RTC, -ENOENT when none was taken, -ESTALE when it
+ * was taken before the device node was created
+ */
+static inline int rtc_snapshot_load(const char *rtc, struct rtc_snapshot *snap)
+{
+	char path[PATH_MAX + 16];
+	struct stat st;
+	ssize_t len;
+	int fd;
+
+	rtc_snapshot_path(path, sizeof(path), rtc);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	len = read(fd, snap, sizeof(*snap));
+	close(fd);
+
+	if (len != sizeof(*snap) || snap->magic != RTC_SNAPSHOT_MAGIC ||
+	    snap->version != RTC_SNAPSHOT_VERSION)
+		return -EINVAL;
+
+	if (!stat(rtc, &st) && st.st_ctime > snap->taken)
+		return -ESTALE;
+
+	return 0;
+}
+
+/*
+ * Whether the RTC is known not to have the RTC_FEATURE_* feature. When the
+ * features could not be read, nothing is known and this is false.
+ */
+static inline int rtc_snapshot_lacks(const struct rtc_snapshot *snap,
+				     unsigned int feature)
+{
+	const struct rtc_snapshot_value *features = &snap->params[0][0];
+
+	return !features->error && !(features->value & (1ULL << feature));
+}
+
+#endif
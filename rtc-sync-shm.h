@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * RTC offset published by rtc-sync --daemon --publish
+ *
+ * The segment is updated under a sequence count so that it can be read
+ * without any system call:
+ *
+ *	struct rtc_sync_shm *shm = rtc_sync_shm_map("rtc0");
+ *	struct rtc_sync_data d;
+ *
+ *	if (shm && !rtc_sync_shm_read(shm, &d))
+ *		... d.offset_ns is the system time minus the RTC time ...
+ */
+#ifndef RTC_SYNC_SHM_H
+#define RTC_SYNC_SHM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RTC_SYNC_SHM_MAGIC	0x52545353	/* "RTSS" */
+#define RTC_SYNC_SHM_VERSION	1
+
+/* The drift has been estimated, drift_ppb is valid */
+#define RTC_SYNC_DRIFT_VALID	(1 << 0)
+
+struct rtc_sync_data {
+	int64_t offset_ns;	/* system time minus RTC time */
+	int64_t ci_ns;		/* 95% confidence interval of the offset */
+	int64_t drift_ppb;	/* how fast the offset grows */
+	int64_t realtime_ns;	/* CLOCK_REALTIME of the measurement */
+	int64_t monotonic_ns;	/* CLOCK_MONOTONIC of the measurement */
+	int64_t flags;
+};
+
+struct rtc_sync_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;		/* odd while the data is being updated */
+	uint32_t reserved;
+	struct rtc_sync_data data;
+};
+
+/* Name of the segment of the RTC device, e.g. "rtc0" */
+static inline void rtc_sync_shm_name(char *name, size_t len, const char *rtc)
+{
+	snprintf(name, len, "/rtc-sync-%s", rtc);
+}
+
+static inline struct rtc_sync_shm *rtc_sync_shm_map(const char *rtc)
+{
+	struct rtc_sync_shm *shm;
+	char name[64];
+	int fd;
+
+	rtc_sync_shm_name(name, sizeof(name), rtc);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return shm == MAP_FAILED ? NULL : shm;
+}
+
+/*
+ * Copy a consistent snapshot of the data, -EAGAIN when nothing has been
+ * published yet.
+ */
+static inline int rtc_sync_shm_read(const struct rtc_sync_shm *shm,
+				    struct rtc_sync_data *d)
+{
+	const int64_t *src = (const int64_t *)&shm->data;
+	int64_t *dst = (int64_t *)d;
+	uint32_t seq;
+	unsigned int i;
+
+	if (shm->magic != RTC_SYNC_SHM_MAGIC ||
+	    shm->version != RTC_SYNC_SHM_VERSION)
+		return -EINVAL;
+
+	do {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		for (i = 0; i < sizeof(*d) / sizeof(*dst); i++)
+			dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+		 seq != __atomic_load_n(&shm->seq, __ATOMIC_RELAXED));
+
+	return seq ? 0 : -EAGAIN;
+}
+
+/* The offset extrapolated to now with the drift */
+static inline int64_t rtc_sync_offset_now(const struct rtc_sync_data *d)
+{
+	struct timespec ts;
+	int64_t elapsed;
+
+	if (!(d->flags & RTC_SYNC_DRIFT_VALID))
+		return d->offset_ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	elapsed = ts.tv_sec * 1000000000LL + ts.tv_nsec - d->monotonic_ns;
+
+	return d->offset_ns + (int64_t)((double)d->drift_ppb * elapsed / 1e9);
+}
+
+#endif
@@ -1,16 +1,151 @@
 // SPDX-License-Identifier: GPL-2.0
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <linux/const.h>
 #include <linux/rtc.h>
+#include <linux/types.h>
 
-#define NSEC_PER_SEC	1000000000L
+#include "rtc-snapshot.h"
+#include "rtc-sync-shm.h"
+
+#define NSEC_PER_SEC	1000000000LL
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
+
+#ifndef RTC_PARAM_GET
+struct rtc_param {
+	__u64 param;
+	union {
+		__u64 uvalue;
+		__s64 svalue;
+		__u64 ptr;
+	};
+	__u32 index;
+	__u32 __pad;
+};
+
+#define RTC_PARAM_GET	_IOW('p', 0x13, struct rtc_param)  /* Get parameter */
+#define RTC_PARAM_SET	_IOW('p', 0x14, struct rtc_param)  /* Set parameter */
+
+#define RTC_FEATURE_ALARM		0
+#define RTC_FEATURE_UPDATE_INTERRUPT	4
+#define RTC_FEATURE_CORRECTION		5
+
+#define RTC_PARAM_FEATURES		0
+#define RTC_PARAM_CORRECTION		1
+#endif
+
+/* Interval between two reads while looking for the edge of a second */
+#define EDGE_COARSE_NS	50000000LL
+/* Number of reads over the edge bracket on each refining round */
+#define EDGE_STEPS	16
+/* Read back to back once the bracket is that narrow */
+#define EDGE_SPIN_NS	1000000LL
+/* Margin for wakeup latency */
+#define EDGE_GUARD_NS	200000LL
+/* Number of times the edge search starts over before giving up */
+#define EDGE_RESTARTS	3
+
+/* Give up waiting for an update or alarm interrupt after that long */
+#define IRQ_TIMEOUT_MS	3000
+/*
+ * How long before a predicted interrupt the wait starts. The bracket starts
+ * there, so the middle of it is up to half of that early.
+ */
+#define IRQ_GUARD_NS	300000LL
+/* Number of offsets measured with each method when calibrating */
+#define CALIB_SAMPLES	4
+
+/* Maximum number of edges measured for an offset estimation */
+#define MAX_EDGE_SAMPLES	64
+/* Samples further than that many deviations from the median are outliers */
+#define OUTLIER_MADS	3
+/* Number of estimations tried to reach the confidence interval */
+#define ESTIMATE_RETRIES	5
+/* Samples measured per kept one before giving up on --max-width */
+#define WIDTH_TRIES	4
+/* Leave at least that long to sleep before setting the RTC */
+#define SET_MARGIN_NS	100000000LL
+#define MAX_SET_SAMPLES	16
+/* Wider brackets are not used to measure the set delay */
+#define SET_MAX_WIDTH_NS	10000000LL
+/* Sets attempted to bring the offset within set_tolerance */
+#define SET_ITERATIONS	3
+/* Edges checking the first set done with a set delay from the state */
+#define VERIFY_EDGES	1
+
+/* Maximum number of offset samples used to estimate the drift */
+#define DRIFT_WINDOW	128
+/* Minimum number of samples and time span before correcting the drift */
+#define DRIFT_MIN_SAMPLES	8
+/* Drift below that, in ppb, is not worth a correction */
+#define DRIFT_DEADBAND	100
+/* Failed measurements in a row before the daemon gives up */
+#define DAEMON_FAILURES	10
+
+#define STATE_FILE	"/var/lib/rtc-sync/state"
+
+static char *rtc_file = "/dev/rtc0";
+static char *state_file = STATE_FILE;
+static int daemonize;
+static int latency_only;
+static int publish;
+static struct rtc_sync_shm *shm;
+static int read_samples = 100;
+static int edge_samples = 5;
+static long long max_ci = 1000000LL;
+static long long max_width;
+static int set_samples = 3;
+static long long set_tolerance = 1000000LL;
+static int recalibrate;
+static long long max_age = 30 * 24 * 3600;
+static int low_jitter;
+static int cpu = -1;
+static long long spin_guard = 500000LL;
+static unsigned int interval = 60;
+static unsigned int drift_span = 3600;
+static long long step_threshold = 100000000LL;
+
+/* Time of an event on the system clocks */
+struct xstamp {
+	long long mono;			/* CLOCK_MONOTONIC, in ns */
+	struct timespec raw;		/* CLOCK_MONOTONIC_RAW */
+	struct timespec rt;		/* CLOCK_REALTIME */
+};
+
+enum {
+	METHOD_ALARM,
+	METHOD_UIE,
+	METHOD_POLL,
+};
+
+/* The RTC reached rtc between before and after */
+struct rtc_sample {
+	time_t rtc;
+	struct xstamp before, after;
+	int method;
+	long long read_lat;	/* last RTC_RD_TIME duration, in ns */
+};
 
 int set_realtime_priority(void)
 {
@@ -26,274 +161,2653 @@ int set_realtime_priority(void)
 	return ret;
 }
 
-void timespec_diff(struct timespec *start, struct timespec *stop,
-                   struct timespec *result)
+long long mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+long long timespec_ns(const struct timespec *ts)
 {
-    if ((stop->tv_nsec - start->tv_nsec) < 0) {
-        result->tv_sec = stop->tv_sec - start->tv_sec - 1;
-        result->tv_nsec = stop->tv_nsec - start->tv_nsec + NSEC_PER_SEC;
-    } else {
-        result->tv_sec = stop->tv_sec - start->tv_sec;
-        result->tv_nsec = stop->tv_nsec - start->tv_nsec;
-    }
+	return (long long)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+long long realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
 
-    return;
+	return timespec_ns(&ts);
 }
 
-int get_offset_uie(struct timespec *diff, int rtc)
+void ns_to_timespec(long long ns, struct timespec *ts)
 {
-	unsigned long data;
-	struct timespec now;
-	struct tm stm;
+	ts->tv_sec = ns / NSEC_PER_SEC;
+	ts->tv_nsec = ns % NSEC_PER_SEC;
+	if (ts->tv_nsec < 0) {
+		ts->tv_sec--;
+		ts->tv_nsec += NSEC_PER_SEC;
+	}
+}
+
+void xstamp_get(struct xstamp *x)
+{
+	clock_gettime(CLOCK_MONOTONIC_RAW, &x->raw);
+	clock_gettime(CLOCK_REALTIME, &x->rt);
+	x->mono = mono_ns();
+}
+
+/* The offset is estimated at the middle of the bracket */
+long long sample_offset(const struct rtc_sample *s)
+{
+	return (timespec_ns(&s->before.rt) + timespec_ns(&s->after.rt)) / 2 -
+	       (long long)s->rtc * NSEC_PER_SEC;
+}
+
+long long sample_width(const struct rtc_sample *s)
+{
+	return timespec_ns(&s->after.rt) - timespec_ns(&s->before.rt);
+}
+
+/* Identify the RTC by its device and driver names */
+void rtc_identity(const char *file, char *id, size_t len)
+{
+	char path[PATH_MAX], name[64] = "";
+	const char *dev;
+	FILE *f;
+
+	if (!realpath(file, path))
+		snprintf(path, sizeof(path), "%s", file);
+	dev = basename(path);
+
+	snprintf(id, len, "/sys/class/rtc/%s/name", dev);
+	f = fopen(id, "r");
+	if (f) {
+		if (fscanf(f, "%63s", name) != 1)
+			name[0] = '\0';
+		fclose(f);
+	}
+	if (!name[0])
+		snprintf(name, sizeof(name), "unknown");
+
+	snprintf(id, len, "%s:%s", dev, name);
+}
+
+#define STATE_MAGIC	"rtc-sync-state"
+#define STATE_VERSION	1
+
+/* Calibration results of one RTC, each with when it was measured */
+struct rtc_state {
+	char id[128];
+	char method[16];
+	long long method_time;
+	long long read_lat;		/* mean RTC_RD_TIME latency, in ns */
+	long long read_lat_time;
+	long long set_delay;		/* RTC_SET_TIME to effect, in ns */
+	long long set_delay_time;
+	double drift;			/* in ppm */
+	long long drift_time;
+};
+
+/*
+ * Where the RTC seconds tick over on CLOCK_MONOTONIC: the RTC reached secs
+ * between lo and hi, the following edges come one second apart.
+ */
+struct rtc_edge {
+	long long lo, hi;
+	time_t secs;
+	int valid;
+};
+
+/* Progress of the edge search of the poll method */
+struct edge_search {
+	struct xstamp last, before, after;
+	long long lo, hi, step, next;
+	long long coarse_start;
+	long long lat_sum;		/* read latency measurement */
+	int lat_n;
+	time_t pre, secs;
+	int coarse, seen, restarts;
+};
+
+/* What a device is waiting for */
+enum dev_wait {
+	WAIT_NONE,		/* idle, the last request completed with rc */
+	WAIT_UIE_FIRST,		/* first update interrupt */
+	WAIT_EDGE_TIMER,	/* sleeping until right before the predicted edge */
+	WAIT_EDGE_IRQ,		/* interrupt of the edge */
+	WAIT_POLL_TIMER,	/* next read of the edge search */
+	WAIT_LAT_TIMER,		/* next read of the latency measurement */
+	WAIT_SET_TIMER,		/* instant at which the RTC is set */
+	WAIT_SLEEP,
+};
+
+struct rtc_dev;
+struct method;
+
+/* File descriptor watched by the event loop */
+struct ev_source {
+	int fd;
+	struct rtc_dev *dev;
+	void (*handler)(struct rtc_dev *dev);
+};
+
+/*
+ * An RTC driven by the event loop. A request, measuring a sample, setting
+ * the RTC at a given time or sleeping, goes through the wait states on the
+ * events of the RTC and of the timers, blocking only where loop_dispatch
+ * says so. Once back to WAIT_NONE, rc holds its result and done, when set,
+ * is called.
+ */
+struct rtc_dev {
+	const char *file;
+	int index;			/* position on the command line */
+	char prefix[64];		/* tags its lines when syncing several */
+	int epfd;
+	struct ev_source irq;		/* the RTC itself */
+	struct ev_source timer;		/* CLOCK_MONOTONIC timerfd */
+	struct ev_source rt_timer;	/* CLOCK_REALTIME timerfd */
+
+	enum dev_wait wait;
 	int rc;
-	int i;
+	void (*done)(struct rtc_dev *dev);
 
-	rc = ioctl(rtc, RTC_UIE_ON, 0);
-	if (rc < 0) {
-		perror("RTC_UIE_ON");
-		return rc;
+	const struct method *method;
+	struct rtc_state state;
+	struct rtc_edge edge;
+	unsigned long ops;		/* ioctls and reads, to compare methods */
+	long long read_lat;		/* mean, drives the edge search */
+	int state_dirty;		/* changed by a handler, saved by dev_run */
+	long long last_read_lat;
+	long long set_delay;
+	int set_calibrated;
+	int uie;			/* update interrupts are enabled */
+	struct rtc_snapshot snap;	/* from rtc info, when has_snap */
+	int has_snap;
+
+	/* Request in progress */
+	struct rtc_sample sample;
+	struct xstamp armed;
+	struct edge_search search;
+	long long set_at;
+	struct tm set_tm;
+};
+
+struct method {
+	const char *name;
+	void (*start)(struct rtc_dev *dev);
+	int feature;			/* RTC_FEATURE_* needed, -1 for none */
+};
+
+/* Print a line, tagged with the device when synchronizing several */
+#define report(dev, fmt, ...) printf("%s" fmt, (dev)->prefix, ##__VA_ARGS__)
+#define report_err(dev, fmt, ...) \
+	fprintf(stderr, "%s" fmt, (dev)->prefix, ##__VA_ARGS__)
+
+/* perror() tagged with the device, errno is preserved for the caller */
+void dev_perror(struct rtc_dev *dev, const char *s)
+{
+	int err = errno;
+
+	report_err(dev, "%s: %s\n", s, strerror(err));
+	errno = err;
+}
+
+/*
+ * Avoid migrations and page faults around the critical instants: stay on
+ * CPU pin, the current one when negative, and lock the memory.
+ */
+int set_low_jitter(struct rtc_dev *dev, int pin)
+{
+	cpu_set_t set;
+
+	if (pin < 0)
+		pin = sched_getcpu();
+
+	if (sched_getaffinity(0, sizeof(set), &set)) {
+		dev_perror(dev, "sched_getaffinity");
+		return -errno;
 	}
 
-	for (i = 0; i < 5; i++) {
-		rc = read(rtc, &data, sizeof(data));
-		if (rc < 0) {
-			perror("read");
-			return rc;
-		}
-		clock_gettime(CLOCK_REALTIME, &now);
-		ioctl(rtc, RTC_RD_TIME, &stm);
-		if (rc < 0) {
-			perror("RTC_RD_TIME");
-			break;
-		}
-		printf("%d %d.%09d\n", timegm(&stm), now.tv_sec, now.tv_nsec);
+	if (pin >= CPU_SETSIZE || !CPU_ISSET(pin, &set)) {
+		report_err(dev, "CPU %d not allowed\n", pin);
+		return -EINVAL;
 	}
 
-	rc = ioctl(rtc, RTC_UIE_OFF, 0);
-	if (rc < 0) {
-		perror("RTC_UIE_OFF");
-		return rc;
+	CPU_ZERO(&set);
+	CPU_SET(pin, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		dev_perror(dev, "sched_setaffinity");
+		return -errno;
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		dev_perror(dev, "mlockall");
+		return -errno;
 	}
 
-	diff->tv_sec = now.tv_sec - timegm(&stm);
-	diff->tv_nsec = now.tv_nsec;
+	report(dev, "Low jitter mode on CPU %d\n", pin);
 
 	return 0;
 }
 
-int get_offset_alarm(struct timespec *diff, int rtc)
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int state_read(FILE *f, struct rtc_state *st)
+{
+	return fscanf(f, "%127s %15s %lld %lld %lld %lld %lld %lf %lld",
+		      st->id, st->method, &st->method_time, &st->read_lat,
+		      &st->read_lat_time, &st->set_delay, &st->set_delay_time,
+		      &st->drift, &st->drift_time) == 9;
+}
+
+void state_write(FILE *f, const struct rtc_state *st)
 {
-	struct rtc_wkalrm alarm = { 0 };
-	struct timespec now;
-	struct tm stm;
-	time_t secs;
-	unsigned long data;
-	int rc;
+	fprintf(f, "%s %s %lld %lld %lld %lld %lld %.3f %lld\n",
+		st->id, st->method, st->method_time, st->read_lat,
+		st->read_lat_time, st->set_delay, st->set_delay_time,
+		st->drift, st->drift_time);
+}
 
-	rc = ioctl(rtc, RTC_RD_TIME, &stm);
-	if (rc < 0) {
-		perror("RTC_RD_TIME");
-		return rc;
+/* Open the state file, ignoring it when it has another format */
+FILE *state_open(void)
+{
+	char magic[32];
+	int version;
+	FILE *f;
+
+	f = fopen(state_file, "r");
+	if (!f)
+		return NULL;
+
+	if (fscanf(f, "%31s %d", magic, &version) != 2 ||
+	    strcmp(magic, STATE_MAGIC) || version != STATE_VERSION) {
+		fclose(f);
+		return NULL;
 	}
 
-	secs = timegm(&stm);
+	return f;
+}
 
-	secs++;
+/* Load the state of the RTC, nothing is known when missing */
+void state_load(struct rtc_dev *dev)
+{
+	struct rtc_state *state = &dev->state;
+	struct rtc_state st;
+	FILE *f;
 
-	gmtime_r(&secs, &stm);
+	memset(state, 0, sizeof(*state));
+	rtc_identity(dev->file, state->id, sizeof(state->id));
+	strcpy(state->method, "-");
 
-	alarm.time.tm_sec = stm.tm_sec;
-	alarm.time.tm_min = stm.tm_min;
-	alarm.time.tm_hour = stm.tm_hour;
-	alarm.time.tm_mday = stm.tm_mday;
-	alarm.time.tm_mon = stm.tm_mon;
-	alarm.time.tm_year = stm.tm_year;
-	alarm.time.tm_wday = -1;
-	alarm.time.tm_yday = -1;
-	alarm.time.tm_isdst = -1;
-	alarm.enabled = 1;
-	rc = ioctl(rtc, RTC_WKALM_SET, &alarm);
-	if (rc < 0) {
-		perror("RTC_WKALM_SET");
-		return rc;
+	pthread_mutex_lock(&state_lock);
+	f = state_open();
+	if (f) {
+		while (state_read(f, &st))
+			if (!strcmp(st.id, state->id))
+				*state = st;
+		fclose(f);
 	}
+	pthread_mutex_unlock(&state_lock);
+}
 
-	rc = read(rtc, &data, sizeof(data));
-	if (rc < 0) {
-		perror("read");
-		return rc;
+/*
+ * Whether a state file error is only the default file being unusable, as
+ * when not running as root: there is then no state, quietly.
+ */
+int state_missing(int err)
+{
+	return !strcmp(state_file, STATE_FILE) &&
+	       (err == ENOENT || err == EACCES);
+}
+
+/* Create the directory of the state file, its parent has to exist */
+void state_mkdir(void)
+{
+	char *dir, *slash;
+
+	dir = strdup(state_file);
+	if (!dir)
+		return;
+
+	slash = strrchr(dir, '/');
+	if (slash && slash != dir) {
+		*slash = '\0';
+		if (mkdir(dir, 0755) && errno != EEXIST &&
+		    !state_missing(errno))
+			perror(dir);
 	}
+	free(dir);
+}
 
-	clock_gettime(CLOCK_REALTIME, &now);
+/* Replace the line of this RTC in the state file */
+void state_save(struct rtc_dev *dev)
+{
+	struct rtc_state st;
+	FILE *in, *out;
+	char *tmp;
 
-	rc = ioctl(rtc, RTC_RD_TIME, &stm);
-	if (rc < 0) {
-		perror("RTC_RD_TIME");
-		return rc;
+	if (asprintf(&tmp, "%s.tmp", state_file) < 0)
+		return;
+
+	pthread_mutex_lock(&state_lock);
+	state_mkdir();
+	out = fopen(tmp, "w");
+	if (!out) {
+		if (!state_missing(errno))
+			perror(tmp);
+		goto out;
 	}
 
-	secs = timegm(&stm);
+	fprintf(out, "%s %d\n", STATE_MAGIC, STATE_VERSION);
+	in = state_open();
+	if (in) {
+		while (state_read(in, &st))
+			if (strcmp(st.id, dev->state.id))
+				state_write(out, &st);
+		fclose(in);
+	}
+	state_write(out, &dev->state);
 
-	printf("%d %d.%09d\n", secs, now.tv_sec, now.tv_nsec);
-	diff->tv_sec = now.tv_sec - secs;
-	diff->tv_nsec = now.tv_nsec;
+	if (fclose(out) || rename(tmp, state_file)) {
+		perror(state_file);
+		unlink(tmp);
+	}
+out:
+	pthread_mutex_unlock(&state_lock);
+	free(tmp);
+}
 
-	return 0;
+/* Whether a value measured at t can be used instead of measuring it again */
+int state_fresh(long long t)
+{
+	return t && !recalibrate && (!max_age || time(NULL) - t <= max_age);
 }
 
-int get_offset_poll(struct timespec *diff, int rtc)
+/* ioctl() on the RTC, counting the operations to compare the methods */
+int rtc_ioctl(struct rtc_dev *dev, unsigned long req, void *arg)
 {
-	struct tm stm;
-	struct timespec now;
+	long long start;
 	int rc;
-	int i, secs;
-	unsigned long m = 0;
-	struct timespec b, a, d;
 
-	for (i = 0; i < 100; i++) {
-		clock_gettime(CLOCK_MONOTONIC, &b);
-		rc = ioctl(rtc, RTC_RD_TIME, &stm);
-		if (rc < 0) {
-			perror("RTC_RD_TIME");
-			return rc;
+	dev->ops++;
+
+	if (req != RTC_RD_TIME)
+		return ioctl(dev->irq.fd, req, arg);
+
+	start = mono_ns();
+	rc = ioctl(dev->irq.fd, req, arg);
+	dev->last_read_lat = mono_ns() - start;
+
+	return rc;
+}
+
+/*
+ * Log-bucketed latency histogram: values below HIST_SUB have their own
+ * bucket, then each power of two is split in HIST_SUB buckets so that the
+ * relative error stays below 1/HIST_SUB.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct latency_hist {
+	unsigned long long count[HIST_BUCKETS];
+	unsigned long long n, sum, min, max;
+};
+
+int hist_index(unsigned long long v)
+{
+	int k;
+
+	if (v < HIST_SUB)
+		return v;
+
+	k = 63 - __builtin_clzll(v);
+
+	return (k - HIST_SUB_BITS + 1) * HIST_SUB +
+	       (v >> (k - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+unsigned long long hist_low(int i)
+{
+	int g = i / HIST_SUB;
+
+	if (!g)
+		return i;
+
+	return (unsigned long long)(HIST_SUB + i % HIST_SUB) << (g - 1);
+}
+
+unsigned long long hist_high(int i)
+{
+	int g = i / HIST_SUB;
+
+	if (!g)
+		return i;
+
+	return hist_low(i) + (1ULL << (g - 1)) - 1;
+}
+
+void hist_add(struct latency_hist *h, unsigned long long v)
+{
+	h->count[hist_index(v)]++;
+	if (!h->n || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->sum += v;
+	h->n++;
+}
+
+/* Upper bound of the bucket holding the p percentile, nearest rank */
+unsigned long long hist_percentile(struct latency_hist *h, double p)
+{
+	unsigned long long rank, seen = 0;
+	int i;
+
+	rank = ceil(p / 100 * h->n);
+	if (!rank)
+		rank = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= rank)
+			return hist_high(i) < h->max ? hist_high(i) : h->max;
+	}
+
+	return h->max;
+}
+
+void hist_print_json(struct latency_hist *h, const char *name, int buckets)
+{
+	int i, first = 1;
+
+	printf("{\"%s\":{\"samples\":%llu,\"min\":%llu,\"mean\":%llu,"
+	       "\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p99.9\":%llu,"
+	       "\"max\":%llu", name, h->n, h->min, h->n ? h->sum / h->n : 0,
+	       hist_percentile(h, 50), hist_percentile(h, 90),
+	       hist_percentile(h, 99), hist_percentile(h, 99.9), h->max);
+
+	if (buckets) {
+		printf(",\"buckets\":[");
+		for (i = 0; i < HIST_BUCKETS; i++) {
+			if (!h->count[i])
+				continue;
+			printf("%s[%llu,%llu,%llu]", first ? "" : ",",
+			       hist_low(i), hist_high(i), h->count[i]);
+			first = 0;
 		}
-		clock_gettime(CLOCK_MONOTONIC, &a);
+		printf("]");
+	}
+
+	printf("}}\n");
+}
 
-		timespec_diff(&b, &a, &d);
+#define LOG_MAGIC	0x52534c47	/* "RSLG" */
+#define LOG_VERSION	1
 
-		m += d.tv_nsec/100 + d.tv_sec * 10000000;
+/*
+ * The sample log is a ring of fixed size records following a header. head
+ * counts the records ever written, a record is complete once its seq is
+ * its position in that count plus one.
+ */
+struct log_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t reserved;
+	uint64_t capacity;
+	uint64_t head;
+};
+
+struct log_record {
+	uint64_t seq;
+	int64_t rtc;			/* RTC seconds reached */
+	int64_t realtime[2];		/* CLOCK_REALTIME bracket, in ns */
+	int64_t monotonic[2];		/* CLOCK_MONOTONIC bracket, in ns */
+	int64_t raw[2];			/* CLOCK_MONOTONIC_RAW bracket, in ns */
+	int64_t read_lat;		/* last RTC_RD_TIME duration, in ns */
+	uint32_t method;
+	uint32_t dev;			/* index of the RTC on the command line */
+};
+
+static char *log_file;
+static uint64_t log_capacity = 65536;
+static struct log_header *log_hdr;
+static struct log_record *log_ring;
+
+/*
+ * Map the log, reusing it when it already has the same layout. Only an empty
+ * file is turned into a new log, anything else could be another's.
+ */
+int log_open(const char *file, int writable)
+{
+	struct log_header hdr;
+	struct stat st;
+	ssize_t rd;
+	size_t len;
+	int fd;
+
+	fd = open(file, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (fd < 0) {
+		perror(file);
+		return -errno;
 	}
 
-	printf("POLL: Mean time to read: %lu\n", m);
+	rd = read(fd, &hdr, sizeof(hdr));
+	if ((rd || !writable) &&
+	    (rd != sizeof(hdr) || hdr.magic != LOG_MAGIC ||
+	     hdr.version != LOG_VERSION ||
+	     hdr.record_size != sizeof(struct log_record) || !hdr.capacity)) {
+		fprintf(stderr, "%s: not a sample log\n", file);
+		close(fd);
+		return -EINVAL;
+	}
 
-	rc = ioctl(rtc, RTC_RD_TIME, &stm);
-	if (rc < 0) {
-		perror("RTC_RD_TIME");
-		return rc;
+	/*
+	 * Mapping past the end of the file would fault on access, a writable
+	 * log is extended below.
+	 */
+	if (!writable && (fstat(fd, &st) ||
+			  (uint64_t)(st.st_size - sizeof(hdr)) /
+			  sizeof(struct log_record) < hdr.capacity)) {
+		fprintf(stderr, "%s: truncated sample log\n", file);
+		close(fd);
+		return -EINVAL;
 	}
 
-	secs = stm.tm_sec;
-	do {
-		clock_gettime(CLOCK_MONOTONIC, &b);
-		ioctl(rtc, RTC_RD_TIME, &stm);
-		if (rc < 0) {
-			perror("RTC_RD_TIME");
-			return rc;
+	if (!rd) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = LOG_MAGIC;
+		hdr.version = LOG_VERSION;
+		hdr.record_size = sizeof(struct log_record);
+		hdr.capacity = log_capacity;
+		if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			perror(file);
+			close(fd);
+			return -EIO;
 		}
-		clock_gettime(CLOCK_MONOTONIC, &a);
-	} while (stm.tm_sec == secs);
+	}
 
-	clock_gettime(CLOCK_REALTIME, &now);
-	printf("POLL: corrected: %d %d.%09d\n", timegm(&stm), now.tv_sec, now.tv_nsec - m);
-	timespec_diff(&b, &a, &d);
-	printf("POLL: Last time to read: %lu %d\n", d.tv_nsec, i);
+	len = sizeof(hdr) + hdr.capacity * sizeof(struct log_record);
+	if (writable && ftruncate(fd, len)) {
+		perror(file);
+		close(fd);
+		return -errno;
+	}
 
-	diff->tv_sec = now.tv_sec - timegm(&stm);
-	diff->tv_nsec = now.tv_nsec - m;
+	log_hdr = mmap(NULL, len, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+		       MAP_SHARED, fd, 0);
+	close(fd);
+	if (log_hdr == MAP_FAILED) {
+		perror("mmap");
+		log_hdr = NULL;
+		return -errno;
+	}
+	log_ring = (struct log_record *)(log_hdr + 1);
 
 	return 0;
 }
 
-int main(void)
+void log_sample(struct rtc_dev *dev, const struct rtc_sample *s)
 {
-	struct timespec now, ts, diff;
-	struct tm stm;
-	time_t secs;
-	int rtc;
-	int rc;
+	struct log_record *r;
+	uint64_t seq;
 
-	int (*get_offset)(struct timespec *diff, int rtc);
+	seq = __atomic_fetch_add(&log_hdr->head, 1, __ATOMIC_RELAXED);
+	r = &log_ring[seq % log_hdr->capacity];
 
-	get_offset = get_offset_alarm;
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r->rtc = s->rtc;
+	r->realtime[0] = timespec_ns(&s->before.rt);
+	r->realtime[1] = timespec_ns(&s->after.rt);
+	r->monotonic[0] = s->before.mono;
+	r->monotonic[1] = s->after.mono;
+	r->raw[0] = timespec_ns(&s->before.raw);
+	r->raw[1] = timespec_ns(&s->after.raw);
+	r->read_lat = s->read_lat;
+	r->method = s->method;
+	r->dev = dev->index;
+	__atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
+}
 
-	clock_getres(CLOCK_REALTIME, &ts);
-	printf("CLOCK_REALTIME %d.%09d\n", ts.tv_sec, ts.tv_nsec);
-	clock_getres(CLOCK_MONOTONIC, &ts);
-	printf("CLOCK_MONOTONIC %d.%09d\n", ts.tv_sec, ts.tv_nsec);
+/* Measure the time taken by RTC_RD_TIME over read_samples reads, in ns */
+int read_latency(struct latency_hist *h, struct rtc_dev *dev)
+{
+	struct tm stm;
+	long long b;
+	int rc, i;
+
+	memset(h, 0, sizeof(*h));
+
+	for (i = 0; i < read_samples; i++) {
+		b = mono_ns();
+		rc = rtc_ioctl(dev, RTC_RD_TIME, &stm);
+		if (rc < 0) {
+			dev_perror(dev, "RTC_RD_TIME");
+			return rc;
+		}
 
-	rtc = open("/dev/rtc0", O_RDONLY);
-	if (rtc < 0) {
-		perror("open");
-		return rtc;
+		hist_add(h, mono_ns() - b);
 	}
 
-	set_realtime_priority();
+	return 0;
+}
 
-	rc = get_offset(&diff, rtc);
-	if (rc)
-		return rc;
-	printf("Current offset: %ds + %09dns = %dns\n", diff.tv_sec, diff.tv_nsec, diff.tv_sec * NSEC_PER_SEC + diff.tv_nsec);
+int arm_timer(struct ev_source *timer, long long ns)
+{
+	struct itimerspec its = { 0 };
 
-	clock_gettime(CLOCK_REALTIME, &now);
+	/* A zero expiration would disarm the timer */
+	ns_to_timespec(ns > 0 ? ns : 1, &its.it_value);
+	if (timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		perror("timerfd_settime");
+		return -errno;
+	}
 
-	/* sleep to the next second unless now is too close */
-	ts.tv_nsec = 0;
-	ts.tv_sec = now.tv_sec + 1;
-	if (ts.tv_nsec > 900000000)
-		ts.tv_sec++;
+	return 0;
+}
 
-	gmtime_r(&ts.tv_sec, &stm);
-	printf("setting %d at %d.%09d\n", ts.tv_sec, ts.tv_sec, ts.tv_nsec);
+int disarm_timer(struct ev_source *timer)
+{
+	struct itimerspec its = { 0 };
 
-	rc = clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL);
-	if (rc) {
-		perror("clock_nanosleep");
-		return rc;
+	if (timerfd_settime(timer->fd, 0, &its, NULL)) {
+		perror("timerfd_settime");
+		return -errno;
 	}
 
-	rc = ioctl(rtc, RTC_SET_TIME, &stm);
-	if (rc < 0) {
-		perror("RTC_SET_TIME");
-		return rc;
+	return 0;
+}
+
+/* Stop the update interrupts, kept on between the samples of a run */
+int uie_off(struct rtc_dev *dev)
+{
+	if (!dev->uie)
+		return 0;
+
+	dev->uie = 0;
+	if (rtc_ioctl(dev, RTC_UIE_OFF, 0) < 0) {
+		dev_perror(dev, "RTC_UIE_OFF");
+		return -errno;
 	}
 
-	rc = get_offset(&diff, rtc);
+	return 0;
+}
+
+void dev_complete(struct rtc_dev *dev, int rc)
+{
+	int err;
+
+	err = disarm_timer(&dev->timer);
+	if (!rc)
+		rc = err;
+	err = disarm_timer(&dev->rt_timer);
+	if (!rc)
+		rc = err;
+
+	/* Whatever went wrong, the next sample starts from scratch */
 	if (rc)
-		return rc;
-	printf("Set offset: %ds + %09dns = %dns\n", diff.tv_sec, diff.tv_nsec, diff.tv_sec * NSEC_PER_SEC + diff.tv_nsec);
+		uie_off(dev);
 
-	clock_gettime(CLOCK_REALTIME, &now);
+	dev->wait = WAIT_NONE;
+	dev->rc = rc;
+	if (dev->done)
+		dev->done(dev);
+}
 
-	/* Calculate the next full second */
-	if (diff.tv_sec < 0) {
-		/*
-		 * RTC is set earlier than system time unless system time is going
-		 * back, this will never be more than 1s
-		 */
-		secs = now.tv_sec;
-		ts.tv_sec = now.tv_sec;
-		ts.tv_nsec =  NSEC_PER_SEC - diff.tv_nsec;
-	} else {
-		/*
-		 * RTC is late so at the next second minus diff.tv_nsec, we need to set
-		 * the RTC to next second + diff.tv_sec
-		 */
-		ts.tv_sec = now.tv_sec;
-		ts.tv_nsec = NSEC_PER_SEC - diff.tv_nsec;
-		secs = ts.tv_sec + 1 + diff.tv_sec;
-	}
+/*
+ * Arm a timer of the device. Without it, nothing would ever wake the request
+ * up, so it completes right away instead.
+ */
+void dev_arm(struct rtc_dev *dev, struct ev_source *timer, long long ns)
+{
+	int rc;
 
-	/* too close, use next second */
-	if (ts.tv_nsec - now.tv_nsec < 100000000) {
-		ts.tv_sec++;
-		secs++;
-	}
+	rc = arm_timer(timer, ns);
+	if (rc)
+		dev_complete(dev, rc);
+}
 
-	gmtime_r(&secs, &stm);
-	printf("setting %d at %d.%09d\n", secs, ts.tv_sec, ts.tv_nsec);
+/* Wait for an RTC interrupt, giving up after IRQ_TIMEOUT_MS */
+void wait_irq(struct rtc_dev *dev, enum dev_wait wait)
+{
+	dev->wait = wait;
+	dev_arm(dev, &dev->timer, mono_ns() + IRQ_TIMEOUT_MS * 1000000LL);
+}
 
-	clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL);
+/*
+ * Predict the next edges from the last interrupt. The RTC does not tick at
+ * exactly the rate of CLOCK_MONOTONIC, so the prediction is re-anchored on
+ * every sample rather than kept from the narrowest one, which would drift
+ * away by the accumulated phase. The end of the bracket is when the
+ * interrupt came, which stays accurate however wide the bracket is.
+ */
+void update_edge(struct rtc_dev *dev, const struct rtc_sample *s)
+{
+	struct rtc_edge *edge = &dev->edge;
 
-	rc = ioctl(rtc, RTC_SET_TIME, &stm);
-	if (rc < 0) {
-		perror("RTC_SET_TIME");
-		return rc;
-	}
+	edge->lo = s->before.mono;
+	edge->hi = s->after.mono;
+	edge->secs = s->rtc;
+	edge->valid = 1;
+}
 
-	rc = get_offset(&diff, rtc);
-	if (rc)
-		return rc;
-	printf("New offset: %ds + %09dns = %dns\n", diff.tv_sec, diff.tv_nsec, diff.tv_sec * NSEC_PER_SEC + diff.tv_nsec);
+/* Complete a sample request, logging the sample */
+void sample_done(struct rtc_dev *dev)
+{
+	dev->sample.read_lat = dev->last_read_lat;
+	if (log_hdr)
+		log_sample(dev, &dev->sample);
 
-	return 0;
+	dev_complete(dev, 0);
+}
+
+/*
+ * The interrupt of the edge came. When it was already there before the
+ * bracket started, the bracket starts at armed instead.
+ */
+void edge_irq(struct rtc_dev *dev, int early)
+{
+	struct rtc_sample *s = &dev->sample;
+
+	xstamp_get(&s->after);
+	if (early || s->before.mono < dev->armed.mono)
+		s->before = dev->armed;
+
+	update_edge(dev, s);
+	sample_done(dev);
+}
+
+/* Right before the predicted edge, or right away when it is unknown */
+void edge_timer(struct rtc_dev *dev)
+{
+	struct rtc_sample *s = &dev->sample;
+	unsigned long data;
+
+	xstamp_get(&s->before);
+	if (read(dev->irq.fd, &data, sizeof(data)) > 0) {
+		/* Too late, the edge happened before this point */
+		dev->ops++;
+		s->after = s->before;
+		s->before = dev->armed;
+		/*
+		 * When the interrupt came is unknown, wait for it without a
+		 * prediction next time.
+		 */
+		dev->edge.valid = 0;
+		sample_done(dev);
+		return;
+	}
+
+	wait_irq(dev, WAIT_EDGE_IRQ);
+}
+
+/*
+ * Wait for the interrupt of the edge at which the RTC reaches secs. When the
+ * edge can be predicted, sleep until right before it so that the bracket is
+ * tight.
+ */
+void wait_edge(struct rtc_dev *dev, time_t secs)
+{
+	struct rtc_edge *edge = &dev->edge;
+	long long target;
+
+	dev->sample.rtc = secs;
+
+	if (edge->valid) {
+		target = edge->hi + (secs - edge->secs) * NSEC_PER_SEC -
+			 IRQ_GUARD_NS;
+		if (target > mono_ns()) {
+			dev->wait = WAIT_EDGE_TIMER;
+			dev_arm(dev, &dev->timer, target);
+			return;
+		}
+	}
+
+	edge_timer(dev);
+}
+
+void start_uie(struct rtc_dev *dev)
+{
+	struct rtc_edge *edge = &dev->edge;
+	unsigned long data;
+	int rc;
+
+	dev->sample.method = METHOD_UIE;
+
+	/*
+	 * Still on from the previous sample, the interrupts that came since
+	 * are dropped. The next one is predicted from the edge when known,
+	 * otherwise it is waited for like after enabling them.
+	 */
+	if (dev->uie) {
+		xstamp_get(&dev->armed);
+		if (read(dev->irq.fd, &data, sizeof(data)) > 0)
+			dev->ops++;
+
+		if (edge->valid)
+			wait_edge(dev, edge->secs + 1 +
+				  (dev->armed.mono - edge->hi) / NSEC_PER_SEC);
+		else
+			wait_irq(dev, WAIT_UIE_FIRST);
+		return;
+	}
+
+	xstamp_get(&dev->armed);
+	rc = rtc_ioctl(dev, RTC_UIE_ON, 0);
+	if (rc < 0) {
+		dev_perror(dev, "RTC_UIE_ON");
+		dev_complete(dev, rc);
+		return;
+	}
+	dev->uie = 1;
+
+	wait_irq(dev, WAIT_UIE_FIRST);
+}
+
+/*
+ * The first interrupt may come early after enabling them, it is only used to
+ * know which second the next one is for.
+ */
+void uie_first(struct rtc_dev *dev)
+{
+	struct tm stm;
+	int rc;
+
+	xstamp_get(&dev->armed);
+	rc = rtc_ioctl(dev, RTC_RD_TIME, &stm);
+	if (rc < 0) {
+		dev_perror(dev, "RTC_RD_TIME");
+		dev_complete(dev, rc);
+		return;
+	}
+
+	wait_edge(dev, timegm(&stm) + 1);
+}
+
+void start_alarm(struct rtc_dev *dev)
+{
+	struct rtc_wkalrm alarm = { 0 };
+	struct tm stm;
+	time_t secs;
+	int rc;
+
+	dev->sample.method = METHOD_ALARM;
+
+	rc = rtc_ioctl(dev, RTC_RD_TIME, &stm);
+	if (rc < 0) {
+		dev_perror(dev, "RTC_RD_TIME");
+		dev_complete(dev, rc);
+		return;
+	}
+
+	secs = timegm(&stm);
+
+	secs++;
+
+	gmtime_r(&secs, &stm);
+
+	alarm.time.tm_sec = stm.tm_sec;
+	alarm.time.tm_min = stm.tm_min;
+	alarm.time.tm_hour = stm.tm_hour;
+	alarm.time.tm_mday = stm.tm_mday;
+	alarm.time.tm_mon = stm.tm_mon;
+	alarm.time.tm_year = stm.tm_year;
+	alarm.time.tm_wday = -1;
+	alarm.time.tm_yday = -1;
+	alarm.time.tm_isdst = -1;
+	alarm.enabled = 1;
+	xstamp_get(&dev->armed);
+	rc = rtc_ioctl(dev, RTC_WKALM_SET, &alarm);
+	if (rc < 0) {
+		dev_perror(dev, "RTC_WKALM_SET");
+		dev_complete(dev, rc);
+		return;
+	}
+
+	wait_edge(dev, secs);
+}
+
+/* Read the RTC, recording when the read was issued and when it completed */
+int read_rtc(struct rtc_dev *dev, time_t *secs, struct xstamp *before,
+	     struct xstamp *after)
+{
+	struct tm stm;
+	int rc;
+
+	xstamp_get(before);
+	rc = rtc_ioctl(dev, RTC_RD_TIME, &stm);
+	xstamp_get(after);
+	if (rc < 0) {
+		dev_perror(dev, "RTC_RD_TIME");
+		return rc;
+	}
+
+	*secs = timegm(&stm);
+
+	return 0;
+}
+
+/*
+ * The poll method waits for the RTC seconds to tick over with as few reads
+ * as possible. The edge is first located by reading every EDGE_COARSE_NS.
+ * Then, on each following second, the bracket is read EDGE_STEPS times until
+ * it is narrow enough to be read back to back. Once the edge is known, it is
+ * predicted and only that last round is needed, until the RTC is set again.
+ * The edge is bracketed by the start of the last read before it and the end
+ * of the first read after it.
+ */
+void poll_round(struct rtc_dev *dev)
+{
+	struct edge_search *e = &dev->search;
+	struct rtc_edge *edge = &dev->edge;
+	long long k;
+
+	/* The next occurrence of the bracket, leaving time to wake up */
+	k = (mono_ns() + EDGE_GUARD_NS - edge->lo) / NSEC_PER_SEC + 1;
+	e->lo = edge->lo + k * NSEC_PER_SEC;
+	e->hi = edge->hi + k * NSEC_PER_SEC;
+	e->pre = edge->secs + k - 1;
+
+	e->step = (e->hi - e->lo) / EDGE_STEPS;
+	if (e->step < dev->read_lat || e->hi - e->lo <= EDGE_SPIN_NS)
+		e->step = 0;
+
+	/* Back to back reads start a bit early to absorb the wakeup */
+	e->next = e->step ? e->lo : e->lo - EDGE_GUARD_NS;
+	e->seen = 0;
+	e->coarse = 0;
+
+	dev->wait = WAIT_POLL_TIMER;
+	dev_arm(dev, &dev->timer, e->next);
+}
+
+void poll_restart(struct rtc_dev *dev)
+{
+	struct edge_search *e = &dev->search;
+	int rc;
+
+	if (dev->edge.valid) {
+		poll_round(dev);
+		return;
+	}
+
+	rc = read_rtc(dev, &e->pre, &e->last, &e->after);
+	if (rc) {
+		dev_complete(dev, rc);
+		return;
+	}
+
+	e->coarse = 1;
+	e->coarse_start = e->last.mono;
+	dev->wait = WAIT_POLL_TIMER;
+	dev_arm(dev, &dev->timer, e->last.mono + EDGE_COARSE_NS);
+}
+
+void poll_coarse(struct rtc_dev *dev)
+{
+	struct edge_search *e = &dev->search;
+	int rc;
+
+	rc = read_rtc(dev, &e->secs, &e->before, &e->after);
+	if (rc) {
+		dev_complete(dev, rc);
+		return;
+	}
+
+	if (e->secs == e->pre) {
+		/* As the interrupt methods, give up on a stopped RTC */
+		if (e->before.mono - e->coarse_start >
+		    IRQ_TIMEOUT_MS * 1000000LL) {
+			report_err(dev, "No RTC tick after %dms\n",
+				   IRQ_TIMEOUT_MS);
+			dev_complete(dev, -ETIMEDOUT);
+			return;
+		}
+		e->last = e->before;
+		dev_arm(dev, &dev->timer, e->last.mono + EDGE_COARSE_NS);
+		return;
+	}
+
+	dev->edge.lo = e->last.mono;
+	dev->edge.hi = e->after.mono;
+	dev->edge.secs = e->secs;
+	dev->edge.valid = 1;
+
+	poll_round(dev);
+}
+
+void poll_timer(struct rtc_dev *dev)
+{
+	struct edge_search *e = &dev->search;
+	struct rtc_edge *edge = &dev->edge;
+	int rc;
+
+	if (e->coarse) {
+		poll_coarse(dev);
+		return;
+	}
+
+	/*
+	 * Without a step, the reads are back to back and done right away,
+	 * blocking the loop, see loop_dispatch.
+	 */
+	for (;;) {
+		e->next += e->step;
+
+		rc = read_rtc(dev, &e->secs, &e->before, &e->after);
+		if (rc) {
+			dev_complete(dev, rc);
+			return;
+		}
+
+		if (e->secs <= e->pre) {
+			e->last = e->before;
+			e->seen = 1;
+		}
+
+		if (e->secs > e->pre ||
+		    e->before.mono > e->hi + e->step + EDGE_GUARD_NS)
+			break;
+
+		if (e->step) {
+			dev_arm(dev, &dev->timer, e->next);
+			return;
+		}
+	}
+
+	if (e->secs <= e->pre || e->secs > e->pre + 1) {
+		/* The edge is not where it was, start over */
+		edge->valid = 0;
+		if (++e->restarts > EDGE_RESTARTS) {
+			report_err(dev, "Unable to find the RTC edge\n");
+			dev_complete(dev, -EIO);
+			return;
+		}
+		poll_restart(dev);
+		return;
+	}
+
+	if (!e->seen) {
+		/* Woke up after the edge, widen the bracket backwards */
+		edge->lo -= edge->hi - edge->lo + EDGE_GUARD_NS;
+		poll_round(dev);
+		return;
+	}
+
+	edge->lo = e->last.mono;
+	edge->hi = e->after.mono;
+	edge->secs = e->secs;
+
+	if (e->step) {
+		poll_round(dev);
+		return;
+	}
+
+	dev->sample.rtc = e->secs;
+	dev->sample.before = e->last;
+	dev->sample.after = e->after;
+
+	sample_done(dev);
+}
+
+/*
+ * One read of the read latency measurement. Each one is a timer step so
+ * that the measurement doesn't hold the event loop for read_samples reads.
+ */
+void poll_latency(struct rtc_dev *dev)
+{
+	struct edge_search *e = &dev->search;
+	struct tm stm;
+	int rc;
+
+	rc = rtc_ioctl(dev, RTC_RD_TIME, &stm);
+	if (rc < 0) {
+		dev_perror(dev, "RTC_RD_TIME");
+		dev_complete(dev, rc);
+		return;
+	}
+
+	e->lat_sum += dev->last_read_lat;
+	if (++e->lat_n < read_samples) {
+		dev_arm(dev, &dev->timer, mono_ns());
+		return;
+	}
+
+	dev->read_lat = e->lat_sum / e->lat_n;
+	report(dev, "Read latency: %lldns\n", dev->read_lat);
+
+	dev->state.read_lat = dev->read_lat;
+	dev->state.read_lat_time = time(NULL);
+	dev->state_dirty = 1;
+
+	poll_restart(dev);
+}
+
+void start_poll(struct rtc_dev *dev)
+{
+	struct edge_search *e = &dev->search;
+
+	dev->sample.method = METHOD_POLL;
+	e->restarts = 0;
+
+	/* The latency only drives the edge search, measure it once */
+	if (dev->read_lat < 0 && state_fresh(dev->state.read_lat_time))
+		dev->read_lat = dev->state.read_lat;
+
+	if (dev->read_lat < 0) {
+		e->lat_sum = 0;
+		e->lat_n = 0;
+		dev->wait = WAIT_LAT_TIMER;
+		dev_arm(dev, &dev->timer, mono_ns());
+		return;
+	}
+
+	poll_restart(dev);
+}
+
+static const struct method methods[] = {
+	{ "alarm", start_alarm, RTC_FEATURE_ALARM },
+	{ "uie", start_uie, RTC_FEATURE_UPDATE_INTERRUPT },
+	{ "poll", start_poll, -1 },
+};
+
+void dev_irq(struct rtc_dev *dev)
+{
+	unsigned long data;
+
+	if (read(dev->irq.fd, &data, sizeof(data)) <= 0)
+		return;
+	dev->ops++;
+
+	switch (dev->wait) {
+	case WAIT_UIE_FIRST:
+		uie_first(dev);
+		break;
+	case WAIT_EDGE_TIMER:
+		edge_irq(dev, 1);
+		break;
+	case WAIT_EDGE_IRQ:
+		edge_irq(dev, 0);
+		break;
+	default:
+		/* Nobody is waiting for it */
+		break;
+	}
+}
+
+void dev_timer(struct rtc_dev *dev)
+{
+	uint64_t expirations;
+
+	if (read(dev->timer.fd, &expirations, sizeof(expirations)) <= 0)
+		return;
+
+	switch (dev->wait) {
+	case WAIT_UIE_FIRST:
+	case WAIT_EDGE_IRQ:
+		report_err(dev, "No RTC interrupt after %dms\n",
+			   IRQ_TIMEOUT_MS);
+		dev_complete(dev, -ETIMEDOUT);
+		break;
+	case WAIT_EDGE_TIMER:
+		edge_timer(dev);
+		break;
+	case WAIT_POLL_TIMER:
+		poll_timer(dev);
+		break;
+	case WAIT_LAT_TIMER:
+		poll_latency(dev);
+		break;
+	case WAIT_SLEEP:
+		dev_complete(dev, 0);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * In low jitter mode, the timer fires spin_guard early and the rest is spun.
+ * Nothing else of the event loop runs meanwhile, which is why each RTC of a
+ * multi-RTC synchronization gets its own thread and event loop.
+ */
+void dev_rt_timer(struct rtc_dev *dev)
+{
+	uint64_t expirations;
+	long long now;
+	int rc;
+
+	if (read(dev->rt_timer.fd, &expirations, sizeof(expirations)) <= 0 ||
+	    dev->wait != WAIT_SET_TIMER)
+		return;
+
+	do
+		now = realtime_ns();
+	while (low_jitter && now < dev->set_at);
+
+	rc = rtc_ioctl(dev, RTC_SET_TIME, &dev->set_tm);
+	if (rc < 0) {
+		dev_perror(dev, "RTC_SET_TIME");
+		dev_complete(dev, rc);
+		return;
+	}
+	dev->edge.valid = 0;
+
+	report(dev, "Wakeup error: %lldns\n", now - dev->set_at);
+	dev_complete(dev, 0);
+}
+
+/* Measure a sample with the method of the device */
+void dev_sample(struct rtc_dev *dev, void (*done)(struct rtc_dev *dev))
+{
+	int rc;
+
+	dev->rc = 0;
+	dev->done = done;
+
+	/* A run of update interrupt samples ends with another method */
+	if (dev->method->start != start_uie) {
+		rc = uie_off(dev);
+		if (rc) {
+			dev_complete(dev, rc);
+			return;
+		}
+	}
+
+	dev->method->start(dev);
+}
+
+/* Set the RTC to secs when the system time reaches at, in ns */
+void dev_set_at(struct rtc_dev *dev, long long at, time_t secs,
+		void (*done)(struct rtc_dev *dev))
+{
+	struct timespec ts;
+	int rc;
+
+	dev->rc = 0;
+	dev->done = done;
+	dev->set_at = at;
+	gmtime_r(&secs, &dev->set_tm);
+
+	/* The edge moves with the set, as would the update interrupts */
+	rc = uie_off(dev);
+	if (rc) {
+		dev_complete(dev, rc);
+		return;
+	}
+
+	ns_to_timespec(at, &ts);
+	report(dev, "setting %lld at %lld.%09ld\n", (long long)secs,
+	       (long long)ts.tv_sec, ts.tv_nsec);
+
+	dev->wait = WAIT_SET_TIMER;
+	dev_arm(dev, &dev->rt_timer, low_jitter ? at - spin_guard : at);
+}
+
+/* Sleep until CLOCK_MONOTONIC reaches ns */
+void dev_sleep_until(struct rtc_dev *dev, long long ns,
+		     void (*done)(struct rtc_dev *dev))
+{
+	int rc;
+
+	dev->rc = 0;
+	dev->done = done;
+
+	/* Not worth an interrupt every second until the next run */
+	rc = uie_off(dev);
+	if (rc) {
+		dev_complete(dev, rc);
+		return;
+	}
+
+	dev->wait = WAIT_SLEEP;
+	dev_arm(dev, &dev->timer, ns);
+}
+
+int ev_add(int epfd, struct ev_source *src)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = src };
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &ev);
+}
+
+void dev_close(struct rtc_dev *dev)
+{
+	struct ev_source *src[] = { &dev->irq, &dev->timer, &dev->rt_timer };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(src); i++) {
+		if (src[i]->fd >= 0)
+			close(src[i]->fd);
+		src[i]->fd = -1;
+	}
+}
+
+/* Open the RTC and its timers and watch them all with epfd */
+int dev_open(struct rtc_dev *dev, const char *file, int index, int epfd)
+{
+	memset(dev, 0, sizeof(*dev));
+	dev->file = file;
+	dev->index = index;
+	dev->epfd = epfd;
+	dev->read_lat = -1;
+
+	dev->irq = (struct ev_source){ -1, dev, dev_irq };
+	dev->timer = (struct ev_source){ -1, dev, dev_timer };
+	dev->rt_timer = (struct ev_source){ -1, dev, dev_rt_timer };
+
+	dev->irq.fd = open(file, O_RDONLY | O_NONBLOCK);
+	if (dev->irq.fd < 0) {
+		perror(file);
+		return -errno;
+	}
+
+	dev->timer.fd = timerfd_create(CLOCK_MONOTONIC,
+				       TFD_NONBLOCK | TFD_CLOEXEC);
+	dev->rt_timer.fd = timerfd_create(CLOCK_REALTIME,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+	if (dev->timer.fd < 0 || dev->rt_timer.fd < 0) {
+		perror("timerfd_create");
+		dev_close(dev);
+		return -errno;
+	}
+
+	if (ev_add(epfd, &dev->irq) || ev_add(epfd, &dev->timer) ||
+	    ev_add(epfd, &dev->rt_timer)) {
+		perror("epoll_ctl");
+		dev_close(dev);
+		return -errno;
+	}
+
+	state_load(dev);
+	dev->has_snap = !rtc_snapshot_load(file, &dev->snap);
+
+	return 0;
+}
+
+/*
+ * Wait for events and run their handlers. Waiting is left to the timers and
+ * interrupts, the read latency is measured one read per timer step and the
+ * state is saved by dev_run once the request completed. Only two handlers
+ * block on purpose: the back to back reads over the last EDGE_SPIN_NS of an
+ * edge bracket and the low jitter spin before setting. Going back through a
+ * timerfd between them would add the wakeup jitter they are there to avoid.
+ */
+int loop_dispatch(int epfd)
+{
+	struct epoll_event ev[16];
+	struct ev_source *src;
+	int i, n;
+
+	n = epoll_wait(epfd, ev, ARRAY_SIZE(ev), -1);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		perror("epoll_wait");
+		return -errno;
+	}
+
+	for (i = 0; i < n; i++) {
+		src = ev[i].data.ptr;
+		src->handler(src->dev);
+	}
+
+	return 0;
+}
+
+/* Run the event loop until the request in progress on dev completes */
+int dev_run(struct rtc_dev *dev)
+{
+	int rc;
+
+	while (dev->wait != WAIT_NONE) {
+		rc = loop_dispatch(dev->epfd);
+		if (rc)
+			return rc;
+	}
+
+	/* Out of the handlers, the file I/O would hold the loop */
+	if (dev->state_dirty) {
+		dev->state_dirty = 0;
+		state_save(dev);
+	}
+
+	return dev->rc;
+}
+
+/* Measure a sample with the given method */
+int take_sample(struct rtc_dev *dev, const struct method *m,
+		struct rtc_sample *s)
+{
+	const struct method *cur = dev->method;
+	int rc;
+
+	dev->method = m;
+	dev_sample(dev, NULL);
+	rc = dev_run(dev);
+	dev->method = cur;
+	if (rc)
+		return rc;
+
+	*s = dev->sample;
+
+	return 0;
+}
+
+/* Set the RTC to secs when the system time reaches at, in ns */
+int set_rtc_at(struct rtc_dev *dev, long long at, time_t secs)
+{
+	dev_set_at(dev, at, secs, NULL);
+
+	return dev_run(dev);
+}
+
+struct offset_estimate {
+	long long offset;	/* system time - RTC time, in ns */
+	long long ci;		/* half width of the 95% confidence interval */
+	long long width;	/* mean bracket width */
+	int samples, kept;
+};
+
+int compare_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+long long median(long long *v, int n)
+{
+	qsort(v, n, sizeof(*v), compare_ll);
+
+	return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/*
+ * Measure n offsets, drop the ones further than OUTLIER_MADS scaled median
+ * absolute deviations from the median and average the others. A single
+ * offset is only known within its bracket, which is used as the interval.
+ */
+int estimate_offset(struct rtc_dev *dev, struct offset_estimate *est, int n)
+{
+	/* Student's t for a 95% confidence interval, by degrees of freedom */
+	static const double t95[] = { 12.71, 4.30, 3.18, 2.78, 2.57,
+				      2.45, 2.36, 2.31, 2.26, 2.23,
+				      2.20, 2.18, 2.16, 2.14, 2.13,
+				      2.12, 2.11, 2.10, 2.09, 2.09,
+				      2.08, 2.07, 2.07, 2.06, 2.06,
+				      2.06, 2.05, 2.05, 2.05, 2.04 };
+	long long x[MAX_EDGE_SAMPLES], d[MAX_EDGE_SAMPLES];
+	long long med, mad, width = 0;
+	double mean = 0, var = 0, t;
+	struct rtc_sample s;
+	int i, rc, tries, df;
+
+	for (i = 0, tries = 0; i < n; tries++) {
+		if (tries >= n * WIDTH_TRIES) {
+			report_err(dev, "No RTC edge bracketed within %lldns\n",
+				   max_width);
+			return -EIO;
+		}
+
+		rc = take_sample(dev, dev->method, &s);
+		if (rc)
+			return rc;
+
+		report(dev, "RTC %lld, bracket %lldns\n", (long long)s.rtc,
+		       sample_width(&s));
+		if (max_width && sample_width(&s) > max_width)
+			continue;
+
+		width += sample_width(&s);
+		x[i++] = sample_offset(&s);
+	}
+	est->width = width / n;
+
+	memcpy(d, x, sizeof(*x) * n);
+	med = median(d, n);
+	for (i = 0; i < n; i++)
+		d[i] = llabs(x[i] - med);
+	mad = median(d, n);
+
+	est->samples = n;
+	est->kept = 0;
+	for (i = 0; i < n; i++) {
+		/* 1.4826 * MAD estimates the standard deviation */
+		if (llabs(x[i] - med) > OUTLIER_MADS * 1.4826 * mad)
+			continue;
+		x[est->kept++] = x[i];
+	}
+
+	for (i = 0; i < est->kept; i++)
+		mean += (double)x[i] / est->kept;
+	est->offset = llround(mean);
+
+	if (n == 1) {
+		est->ci = est->width / 2;
+		return 0;
+	}
+	if (est->kept < 2) {
+		est->ci = LLONG_MAX;
+		return 0;
+	}
+
+	for (i = 0; i < est->kept; i++)
+		var += (x[i] - mean) * (x[i] - mean) / (est->kept - 1);
+
+	/* Past the table, t is within 0.1% of 1.96 + 2.4 / df */
+	df = est->kept - 1;
+	t = df <= (int)ARRAY_SIZE(t95) ? t95[df - 1] : 1.96 + 2.4 / df;
+	est->ci = llround(t * sqrt(var / est->kept));
+
+	return 0;
+}
+
+/*
+ * Estimate the offset over n edges again until the confidence interval is
+ * below max_ci. When it never is, est is the tightest estimate and -ERANGE
+ * is returned.
+ */
+int estimate_offset_tight(struct rtc_dev *dev, struct offset_estimate *est,
+			  int n)
+{
+	struct offset_estimate cur;
+	int i, rc;
+
+	for (i = 0; i < ESTIMATE_RETRIES; i++) {
+		rc = estimate_offset(dev, &cur, n);
+		if (rc)
+			return rc;
+
+		report(dev, "Offset: %lldns +/- %lldns, %d/%d samples kept, bracket %lldns\n",
+		       cur.offset, cur.ci == LLONG_MAX ? -1 : cur.ci,
+		       cur.kept, cur.samples, cur.width);
+
+		if (!i || cur.ci < est->ci)
+			*est = cur;
+		if (est->ci <= max_ci)
+			return 0;
+	}
+
+	report_err(dev, "Offset confidence interval above %lldns\n", max_ci);
+
+	return -ERANGE;
+}
+
+/*
+ * Set the RTC so that it reads the system time on a second boundary,
+ * issuing RTC_SET_TIME delay ns before it.
+ */
+int set_rtc_early(struct rtc_dev *dev, long long delay)
+{
+	time_t secs;
+
+	secs = (realtime_ns() + delay + SET_MARGIN_NS) / NSEC_PER_SEC + 1;
+
+	return set_rtc_at(dev, secs * NSEC_PER_SEC - delay, secs);
+}
+
+/*
+ * Measure the delay between issuing RTC_SET_TIME and the RTC taking the new
+ * time into account, as the offset of the RTC after setting it exactly on
+ * a second boundary. The median over set_samples sets is kept.
+ */
+int calibrate_set(struct rtc_dev *dev, long long *delay)
+{
+	long long d[MAX_SET_SAMPLES];
+	struct rtc_sample s;
+	int i, rc, tries;
+
+	for (i = 0; i < set_samples; i++) {
+		rc = set_rtc_early(dev, 0);
+		if (rc)
+			return rc;
+
+		/*
+		 * The edge is unknown right after a set, an interrupt based
+		 * sample then only locates it.
+		 */
+		tries = 0;
+		do {
+			rc = take_sample(dev, dev->method, &s);
+			if (rc)
+				return rc;
+		} while (sample_width(&s) > SET_MAX_WIDTH_NS &&
+			 ++tries < WIDTH_TRIES);
+
+		d[i] = sample_offset(&s);
+		report(dev, "SET: delay %lldns, bracket %lldns\n", d[i],
+		       sample_width(&s));
+	}
+
+	*delay = median(d, set_samples);
+	report(dev, "SET: delay min %lldns median %lldns max %lldns\n",
+	       d[0], *delay, d[set_samples - 1]);
+
+	return 0;
+}
+
+/*
+ * Step the RTC to the system time. The write is issued early by the
+ * calibrated set delay, then the residual offset is measured and folded into
+ * the delay until it is within set_tolerance.
+ */
+int sync_rtc(struct rtc_dev *dev)
+{
+	struct offset_estimate est;
+	int i, rc, quick = 0;
+
+	if (!dev->set_calibrated && state_fresh(dev->state.set_delay_time)) {
+		dev->set_delay = dev->state.set_delay;
+		dev->set_calibrated = 1;
+		quick = 1;
+		report(dev, "Set delay: %lldns\n", dev->set_delay);
+	}
+
+	/* Only worth knowing when the RTC is about to be calibrated */
+	if (!dev->set_calibrated) {
+		rc = estimate_offset_tight(dev, &est, edge_samples);
+		if (rc && rc != -ERANGE)
+			return rc;
+		report(dev, "Current offset: %lldns\n", est.offset);
+
+		rc = calibrate_set(dev, &dev->set_delay);
+		if (rc)
+			return rc;
+		dev->set_calibrated = 1;
+	}
+
+	for (i = 0; i < SET_ITERATIONS; i++) {
+		rc = set_rtc_early(dev, dev->set_delay);
+		if (rc)
+			return rc;
+
+		/*
+		 * A known RTC only gets a quick check, the full estimation is
+		 * left for when it missed the tolerance.
+		 */
+		rc = estimate_offset_tight(dev, &est, quick && !i ?
+					   VERIFY_EDGES : edge_samples);
+		if (rc && rc != -ERANGE)
+			return rc;
+		report(dev, "New offset: %lldns, set delay %lldns\n", est.offset,
+		       dev->set_delay);
+
+		/* Setting it again would not make the estimate any tighter */
+		if (llabs(est.offset) <= set_tolerance && rc)
+			return rc;
+
+		if (llabs(est.offset) <= set_tolerance) {
+			dev->state.set_delay = dev->set_delay;
+			dev->state.set_delay_time = time(NULL);
+			state_save(dev);
+			return 0;
+		}
+
+		dev->set_delay += est.offset;
+	}
+
+	report_err(dev, "Offset above %lldns after %d sets\n", set_tolerance,
+		   SET_ITERATIONS);
+
+	return -ERANGE;
+}
+
+struct drift_fit {
+	double x[DRIFT_WINDOW];		/* CLOCK_MONOTONIC, in s */
+	double y[DRIFT_WINDOW];		/* system time - RTC time, in ns */
+	int first, n;
+};
+
+void drift_add(struct drift_fit *fit, double x, double y)
+{
+	int i = (fit->first + fit->n) % DRIFT_WINDOW;
+
+	fit->x[i] = x;
+	fit->y[i] = y;
+	if (fit->n < DRIFT_WINDOW)
+		fit->n++;
+	else
+		fit->first = (fit->first + 1) % DRIFT_WINDOW;
+}
+
+/* Least squares fit of the offset, the slope in ns/s is the drift in ppb */
+int drift_estimate(struct drift_fit *fit, double *ppb, double *span)
+{
+	double mx = 0, my = 0, sxx = 0, sxy = 0, dx;
+	int i, j;
+
+	if (fit->n < DRIFT_MIN_SAMPLES)
+		return -EAGAIN;
+
+	for (i = 0; i < fit->n; i++) {
+		j = (fit->first + i) % DRIFT_WINDOW;
+		mx += fit->x[j];
+		my += fit->y[j];
+	}
+	mx /= fit->n;
+	my /= fit->n;
+
+	for (i = 0; i < fit->n; i++) {
+		j = (fit->first + i) % DRIFT_WINDOW;
+		dx = fit->x[j] - mx;
+		sxx += dx * dx;
+		sxy += dx * (fit->y[j] - my);
+	}
+
+	j = (fit->first + fit->n - 1) % DRIFT_WINDOW;
+	*span = fit->x[j] - fit->x[fit->first];
+	if (sxx == 0)
+		return -EAGAIN;
+
+	*ppb = sxy / sxx;
+
+	return 0;
+}
+
+int has_correction(struct rtc_dev *dev)
+{
+	struct rtc_param param = { .param = RTC_PARAM_FEATURES };
+
+	if (dev->has_snap && !dev->snap.params[0][RTC_PARAM_FEATURES].error)
+		return !rtc_snapshot_lacks(&dev->snap, RTC_FEATURE_CORRECTION);
+
+	if (rtc_ioctl(dev, RTC_PARAM_GET, &param) < 0)
+		return 0;
+
+	return !!(param.uvalue & _BITUL(RTC_FEATURE_CORRECTION));
+}
+
+/*
+ * The RTC correction is in ppb, a positive value slows the RTC down. When the
+ * offset to the system time increases, the RTC is slow and the correction has
+ * to be lowered by the drift.
+ */
+int correct_drift(struct rtc_dev *dev, double ppb)
+{
+	struct rtc_param param = { .param = RTC_PARAM_CORRECTION };
+	long long old;
+	int rc;
+
+	rc = rtc_ioctl(dev, RTC_PARAM_GET, &param);
+	if (rc < 0) {
+		dev_perror(dev, "RTC_PARAM_GET");
+		return rc;
+	}
+
+	old = param.svalue;
+	param.svalue = old - (long long)ppb;
+	rc = rtc_ioctl(dev, RTC_PARAM_SET, &param);
+	if (rc < 0) {
+		dev_perror(dev, "RTC_PARAM_SET");
+		return rc;
+	}
+
+	/* The hardware may not have the requested resolution */
+	rtc_ioctl(dev, RTC_PARAM_GET, &param);
+	report(dev, "Correction: %lld ppb -> %lld ppb\n", old,
+	       (long long)param.svalue);
+
+	return 0;
+}
+
+/* Create the shared memory segment where the offset of the RTC is published */
+int shm_create(void)
+{
+	char path[PATH_MAX], name[64];
+	int fd;
+
+	if (!realpath(rtc_file, path))
+		snprintf(path, sizeof(path), "%s", rtc_file);
+	rtc_sync_shm_name(name, sizeof(name), basename(path));
+
+	fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror(name);
+		return -errno;
+	}
+
+	if (ftruncate(fd, sizeof(*shm))) {
+		perror(name);
+		close(fd);
+		return -errno;
+	}
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		perror("mmap");
+		shm = NULL;
+		return -errno;
+	}
+
+	/* A previous instance may have died in the middle of an update */
+	if (shm->seq & 1)
+		__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+	shm->version = RTC_SYNC_SHM_VERSION;
+	shm->magic = RTC_SYNC_SHM_MAGIC;
+
+	return 0;
+}
+
+/* Update the data under the sequence count, see rtc_sync_shm_read() */
+void shm_publish(const struct rtc_sync_data *d)
+{
+	const int64_t *src = (const int64_t *)d;
+	int64_t *dst = (int64_t *)&shm->data;
+	uint32_t seq = shm->seq;
+	unsigned int i;
+
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (i = 0; i < sizeof(*d) / sizeof(*dst); i++)
+		__atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Measure the offset between the RTC and the system time, step the RTC when
+ * it is too far off and correct its drift when supported.
+ */
+int discipline_step(struct rtc_dev *dev, struct drift_fit *fit, int correction,
+		    int seed)
+{
+	struct rtc_sync_data d = { 0 };
+	struct offset_estimate est;
+	struct timespec now;
+	long long offset;
+	double ppb, span;
+	int rc;
+
+	rc = estimate_offset(dev, &est, edge_samples);
+	if (rc)
+		return rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	offset = est.offset;
+	report(dev, "Offset: %lldns +/- %lldns\n", offset,
+	       est.ci == LLONG_MAX ? -1 : est.ci);
+
+	if (llabs(offset) > step_threshold) {
+		fit->n = 0;
+		/* Out of the targets, the next measurement tells */
+		rc = sync_rtc(dev);
+		return rc == -ERANGE ? 0 : rc;
+	}
+
+	d.offset_ns = offset;
+	d.ci_ns = est.ci;
+	d.realtime_ns = realtime_ns();
+	d.monotonic_ns = now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+
+	drift_add(fit, now.tv_sec + now.tv_nsec / 1e9, offset);
+
+	rc = drift_estimate(fit, &ppb, &span);
+	if (seed && (rc || span < drift_span)) {
+		d.drift_ppb = llround(dev->state.drift * 1000);
+		d.flags = RTC_SYNC_DRIFT_VALID;
+	}
+
+	if (!rc) {
+		report(dev, "Drift: %.3f ppm over %.0fs\n", ppb / 1000, span);
+
+		if (!seed || span >= drift_span) {
+			d.drift_ppb = llround(ppb);
+			d.flags = RTC_SYNC_DRIFT_VALID;
+		}
+
+		if (span >= drift_span) {
+			dev->state.drift = ppb / 1000;
+			dev->state.drift_time = time(NULL);
+			state_save(dev);
+		}
+
+		if (correction && span >= drift_span &&
+		    fabs(ppb) > DRIFT_DEADBAND) {
+			rc = correct_drift(dev, ppb);
+			if (rc)
+				return rc;
+			fit->n = 0;
+			d.flags = 0;
+		}
+	}
+
+	if (shm)
+		shm_publish(&d);
+
+	return 0;
+}
+
+/*
+ * Keep the RTC disciplined, measuring every interval. A failed measurement,
+ * such as a missed interrupt, is tried again at the next interval, the
+ * daemon only gives up after DAEMON_FAILURES of them in a row.
+ */
+int discipline(struct rtc_dev *dev)
+{
+	struct drift_fit fit = { 0 };
+	int correction, seed;
+	int failures = 0;
+	long long next;
+	int rc;
+
+	correction = has_correction(dev);
+	if (!correction)
+		report(dev, "RTC_FEATURE_CORRECTION not supported, only stepping\n");
+
+	if (dev->state.drift_time)
+		report(dev, "Last drift: %.3f ppm, %llds ago\n", dev->state.drift,
+		       (long long)time(NULL) - dev->state.drift_time);
+
+	/*
+	 * Without a correction, the RTC keeps drifting as it did and the last
+	 * drift is published until the fit spans drift_span. With one, it was
+	 * corrected since.
+	 */
+	seed = !correction && state_fresh(dev->state.drift_time);
+
+	next = mono_ns();
+
+	for (;;) {
+		rc = discipline_step(dev, &fit, correction, seed);
+		if (!rc) {
+			failures = 0;
+		} else if (++failures < DAEMON_FAILURES) {
+			report_err(dev, "Measurement failed (%s), retrying in %us\n",
+				   strerror(-rc), interval);
+			/* Whatever failed, locate the edge again */
+			dev->edge.valid = 0;
+		} else {
+			report_err(dev, "%d measurements failed in a row, giving up\n",
+				   failures);
+			return rc;
+		}
+
+		next += (long long)interval * NSEC_PER_SEC;
+		dev_sleep_until(dev, next, NULL);
+		rc = dev_run(dev);
+		if (rc)
+			return rc;
+	}
+}
+
+const struct method *find_method(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(methods); i++)
+		if (!strcmp(name, methods[i].name))
+			return &methods[i];
+
+	return NULL;
+}
+
+/* Whether the snapshot of the RTC, if any, allows using the method */
+int method_supported(struct rtc_dev *dev, const struct method *m)
+{
+	return !dev->has_snap || m->feature < 0 ||
+	       !rtc_snapshot_lacks(&dev->snap, m->feature);
+}
+
+/* Print the complete records of the log, oldest first, as CSV or JSON lines */
+int log_export(const char *file, int json)
+{
+	const struct log_record *r;
+	struct log_record rec;
+	uint64_t seq, first;
+	const char *name;
+
+	if (log_open(file, 0))
+		return 1;
+
+	seq = __atomic_load_n(&log_hdr->head, __ATOMIC_ACQUIRE);
+	first = seq > log_hdr->capacity ? seq - log_hdr->capacity : 0;
+
+	if (!json)
+		printf("seq,dev,method,rtc,realtime_before,realtime_after,"
+		       "monotonic_before,monotonic_after,raw_before,raw_after,"
+		       "read_lat\n");
+
+	for (; first < seq; first++) {
+		/* Skip the records being rewritten while they are copied */
+		r = &log_ring[first % log_hdr->capacity];
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != first + 1)
+			continue;
+		rec = *r;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != first + 1)
+			continue;
+		r = &rec;
+
+		name = r->method < ARRAY_SIZE(methods) ?
+		       methods[r->method].name : "unknown";
+
+		printf(json ?
+		       "{\"seq\":%llu,\"dev\":%u,\"method\":\"%s\",\"rtc\":%lld,"
+		       "\"realtime\":[%lld,%lld],\"monotonic\":[%lld,%lld],"
+		       "\"raw\":[%lld,%lld],\"read_lat\":%lld}\n" :
+		       "%llu,%u,%s,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld\n",
+		       (unsigned long long)first, r->dev, name,
+		       (long long)r->rtc,
+		       (long long)r->realtime[0], (long long)r->realtime[1],
+		       (long long)r->monotonic[0], (long long)r->monotonic[1],
+		       (long long)r->raw[0], (long long)r->raw[1],
+		       (long long)r->read_lat);
+	}
+
+	return 0;
+}
+
+/*
+ * Measure CALIB_SAMPLES offsets with each method and pick the one with the
+ * lowest dispersion. Methods within 10% of the best are considered equal, the
+ * one costing the fewest ioctls and reads wins, as they may each be a slow
+ * bus transaction, then the quickest one. Samples wider than
+ * SET_MAX_WIDTH_NS are taken again, they only locate the edge.
+ */
+const struct method *calibrate_method(struct rtc_dev *dev)
+{
+	double sd[ARRAY_SIZE(methods)], dur[ARRAY_SIZE(methods)];
+	double x[CALIB_SAMPLES], mean, var, width;
+	unsigned long ops, cost[ARRAY_SIZE(methods)];
+	const struct method *best = NULL;
+	struct rtc_sample s;
+	long long start;
+	unsigned int i, j;
+	int rc = 0, tries;
+
+	for (i = 0; i < ARRAY_SIZE(methods); i++) {
+		sd[i] = -1;
+		if (!method_supported(dev, &methods[i])) {
+			report(dev, "CALIB: %s: not supported\n",
+			       methods[i].name);
+			continue;
+		}
+
+		start = mono_ns();
+		ops = dev->ops;
+
+		for (j = 0, width = 0; j < CALIB_SAMPLES; j++) {
+			/*
+			 * Until the method located the edge, its samples are
+			 * bracketed from the start of the wait.
+			 */
+			tries = 0;
+			do {
+				rc = take_sample(dev, &methods[i], &s);
+			} while (!rc && sample_width(&s) > SET_MAX_WIDTH_NS &&
+				 ++tries < WIDTH_TRIES);
+			if (rc)
+				break;
+			x[j] = sample_offset(&s);
+			width += (double)sample_width(&s) / CALIB_SAMPLES;
+		}
+
+		if (rc) {
+			report(dev, "CALIB: %s: not usable\n", methods[i].name);
+			continue;
+		}
+
+		for (j = 0, mean = 0; j < CALIB_SAMPLES; j++)
+			mean += x[j] / CALIB_SAMPLES;
+		for (j = 0, var = 0; j < CALIB_SAMPLES; j++)
+			var += (x[j] - mean) * (x[j] - mean) / (CALIB_SAMPLES - 1);
+
+		sd[i] = sqrt(var);
+		dur[i] = (double)(mono_ns() - start) / CALIB_SAMPLES;
+		cost[i] = (dev->ops - ops) / CALIB_SAMPLES;
+		report(dev, "CALIB: %s: stddev %.0fns, bracket %.0fns, %.0fms and %lu ioctls per sample\n",
+		       methods[i].name, sd[i], width, dur[i] / 1000000,
+		       cost[i]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(methods); i++) {
+		if (sd[i] < 0)
+			continue;
+		if (!best) {
+			best = &methods[i];
+			continue;
+		}
+
+		j = best - methods;
+		if (sd[i] < sd[j] * 0.9 ||
+		    (sd[i] <= sd[j] * 1.1 &&
+		     (cost[i] < cost[j] ||
+		      (cost[i] == cost[j] && dur[i] < dur[j]))))
+			best = &methods[i];
+	}
+
+	return best;
+}
+
+/* Pick the method that suits the RTC best, from the state or by measuring */
+const struct method *pick_method(struct rtc_dev *dev)
+{
+	const struct method *m = NULL;
+
+	if (state_fresh(dev->state.method_time))
+		m = find_method(dev->state.method);
+	if (m && method_supported(dev, m))
+		return m;
+
+	m = calibrate_method(dev);
+	if (!m) {
+		fprintf(stderr, "%s: no usable method\n", dev->file);
+		return NULL;
+	}
+
+	snprintf(dev->state.method, sizeof(dev->state.method), "%s", m->name);
+	dev->state.method_time = time(NULL);
+	state_save(dev);
+
+	return m;
+}
+
+/* An RTC synchronized along with the others, by its own thread */
+struct rtc_worker {
+	const char *file;
+	const struct method *m;
+	struct rtc_dev dev;
+	pthread_t thread;
+	int started;
+	int index;
+	int cpu;		/* for the low jitter mode */
+	int rc;
+	int missed;		/* max_ci not reached on the last offset */
+	long long delay;	/* set delay, in ns */
+	long long offset;	/* after the last set, in ns */
+};
+
+static struct rtc_worker *workers;
+static int nworkers;
+static pthread_barrier_t set_barrier;
+/* Held until the barrier is sized to the workers actually started */
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t set_secs;
+static int set_again;
+
+/*
+ * Decide whether the RTCs are set once more and to which second, leaving
+ * enough time for the slowest one to issue its write early.
+ */
+void plan_set(int round)
+{
+	long long delay = 0;
+	int i;
+
+	set_again = 0;
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].rc)
+			continue;
+		if (!round || llabs(workers[i].offset) > set_tolerance)
+			set_again = round < SET_ITERATIONS;
+		if (workers[i].delay > delay)
+			delay = workers[i].delay;
+	}
+
+	set_secs = (realtime_ns() + delay + SET_MARGIN_NS) / NSEC_PER_SEC + 1;
+}
+
+/*
+ * Measure the offset and the set delay of one RTC, then set it on the same
+ * second as the others. A worker that failed keeps going through the
+ * barriers so that the others are not blocked.
+ */
+void *sync_worker(void *arg)
+{
+	struct rtc_worker *w = arg;
+	struct rtc_dev *dev = &w->dev;
+	struct offset_estimate est;
+	int epfd, round, quick = 0;
+
+	pthread_mutex_lock(&start_lock);
+	pthread_mutex_unlock(&start_lock);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		w->rc = -errno;
+	} else {
+		w->rc = dev_open(dev, w->file, w->index, epfd);
+		snprintf(dev->prefix, sizeof(dev->prefix), "%s: ", w->file);
+	}
+
+	if (!w->rc) {
+		set_realtime_priority();
+		if (low_jitter)
+			w->rc = set_low_jitter(dev, w->cpu);
+	}
+
+	if (!w->rc && w->m && !method_supported(dev, w->m)) {
+		report(dev, "%s not supported\n", w->m->name);
+		w->m = NULL;
+	}
+
+	if (!w->rc && !w->m) {
+		w->m = pick_method(dev);
+		if (!w->m)
+			w->rc = -ENODEV;
+	}
+
+	if (!w->rc) {
+		report(dev, "using %s\n", w->m->name);
+		dev->method = w->m;
+	}
+
+	if (!w->rc && state_fresh(dev->state.set_delay_time)) {
+		w->delay = dev->state.set_delay;
+		quick = 1;
+	} else if (!w->rc) {
+		w->rc = estimate_offset_tight(dev, &est, edge_samples);
+		if (w->rc == -ERANGE)
+			w->rc = 0;
+		w->offset = est.offset;
+		if (!w->rc)
+			w->rc = calibrate_set(dev, &w->delay);
+	}
+
+	for (round = 0; ; round++) {
+		if (pthread_barrier_wait(&set_barrier) ==
+		    PTHREAD_BARRIER_SERIAL_THREAD)
+			plan_set(round);
+		pthread_barrier_wait(&set_barrier);
+
+		if (!set_again)
+			break;
+		if (w->rc || (round && llabs(w->offset) <= set_tolerance))
+			continue;
+
+		w->rc = set_rtc_at(dev, set_secs * NSEC_PER_SEC - w->delay,
+				   set_secs);
+		if (!w->rc)
+			w->rc = estimate_offset_tight(dev, &est,
+						      quick && !round ?
+						      VERIFY_EDGES :
+						      edge_samples);
+		w->missed = w->rc == -ERANGE;
+		if (w->missed)
+			w->rc = 0;
+		if (!w->rc) {
+			w->offset = est.offset;
+			w->delay += est.offset;
+		}
+	}
+
+	if (!w->rc && (w->missed || llabs(w->offset) > set_tolerance))
+		w->rc = -ERANGE;
+
+	if (!w->rc) {
+		dev->state.set_delay = w->delay;
+		dev->state.set_delay_time = time(NULL);
+		state_save(dev);
+	}
+
+	if (epfd >= 0) {
+		dev_close(dev);
+		close(epfd);
+	}
+
+	return NULL;
+}
+
+/*
+ * CPU of a worker in low jitter mode: the ones the process may run on from
+ * the -P one, or else from the first one, so that the spinning workers do
+ * not hold up one another. A -P CPU that is not allowed is left to
+ * set_low_jitter to report.
+ */
+int worker_cpu(int index)
+{
+	cpu_set_t set;
+	int i, k, first = cpu >= 0 ? cpu : 0;
+
+	if (sched_getaffinity(0, sizeof(set), &set)) {
+		perror("sched_getaffinity");
+		return cpu;
+	}
+
+	if (first >= CPU_SETSIZE || (cpu >= 0 && !CPU_ISSET(cpu, &set)))
+		return cpu;
+
+	k = index % CPU_COUNT(&set);
+	for (i = 0; i < CPU_SETSIZE; i++)
+		if (CPU_ISSET((first + i) % CPU_SETSIZE, &set) && !k--)
+			return (first + i) % CPU_SETSIZE;
+
+	return -1;
+}
+
+/* Synchronize all the RTCs and report how far apart they ended up */
+int sync_rtcs(char **files, int n, const struct method *m)
+{
+	long long lo = LLONG_MAX, hi = LLONG_MIN;
+	int i, rc, started, failed = 0, missed = 0;
+
+	workers = calloc(n, sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+	nworkers = n;
+
+	for (i = 0; i < n; i++) {
+		workers[i].file = files[i];
+		workers[i].m = m;
+		workers[i].index = i;
+		workers[i].cpu = worker_cpu(i);
+	}
+
+	/* A worker that could not be started is left out of the barrier */
+	pthread_mutex_lock(&start_lock);
+	for (i = 0, started = 0; i < n; i++) {
+		rc = pthread_create(&workers[i].thread, NULL, sync_worker,
+				    &workers[i]);
+		if (rc) {
+			fprintf(stderr, "%s: pthread_create: %s\n",
+				workers[i].file, strerror(rc));
+			workers[i].rc = -rc;
+			continue;
+		}
+		workers[i].started = 1;
+		started++;
+	}
+	if (started)
+		pthread_barrier_init(&set_barrier, NULL, started);
+	pthread_mutex_unlock(&start_lock);
+
+	for (i = 0; i < n; i++)
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < n; i++) {
+		struct rtc_worker *w = &workers[i];
+
+		if (w->rc && w->rc != -ERANGE) {
+			printf("%s: failed (%s)\n", w->file, strerror(-w->rc));
+			failed++;
+			continue;
+		}
+
+		printf("%s: offset %lldns, set delay %lldns%s\n", w->file,
+		       w->offset, w->delay,
+		       w->rc ? ", targets not reached" : "");
+		if (w->rc)
+			missed++;
+		if (w->offset < lo)
+			lo = w->offset;
+		if (w->offset > hi)
+			hi = w->offset;
+	}
+
+	if (n - failed > 1)
+		printf("Skew: %lldns\n", hi - lo);
+
+	if (started)
+		pthread_barrier_destroy(&set_barrier);
+	free(workers);
+
+	return failed ? -EIO : missed ? -ERANGE : 0;
+}
+
+/* A sync that did not reach --max-ci or --tolerance exits with 2 */
+int exit_code(int rc)
+{
+	if (rc == -ERANGE)
+		return 2;
+
+	return rc ? 1 : 0;
+}
+
+void usage(char *name)
+{
+	fprintf(stderr, "usage: %s [options] [DEVICE...]\n", name);
+	fprintf(stderr, "  DEVICE                RTCs to set on the same second (%s)\n",
+		rtc_file);
+	fprintf(stderr, "  -d, --daemon          keep the RTC disciplined to the system time\n");
+	fprintf(stderr, "  -p, --publish         publish the offset in shared memory, see rtc-sync-shm.h\n");
+	fprintf(stderr, "  -i, --interval SECS   time between two measurements (%u)\n",
+		interval);
+	fprintf(stderr, "  -s, --step MS         step the RTC when the offset exceeds it (%lld)\n",
+		step_threshold / 1000000);
+	fprintf(stderr, "  -S, --span SECS       minimum span of the drift estimation (%u)\n",
+		drift_span);
+	fprintf(stderr, "  -m, --method METHOD   alarm, uie, poll or auto (alarm)\n");
+	fprintf(stderr, "  -c, --state FILE      calibration state of the RTCs (%s)\n",
+		state_file);
+	fprintf(stderr, "  -a, --max-age SECS    recalibrate older state, 0 never does (%lld)\n",
+		max_age);
+	fprintf(stderr, "  -R, --recalibrate     ignore the calibration state\n");
+	fprintf(stderr, "  -e, --edges N         edges measured per offset estimation (%d)\n",
+		edge_samples);
+	fprintf(stderr, "                        from 2 to %d, the interval needs two\n",
+		MAX_EDGE_SAMPLES);
+	fprintf(stderr, "  -C, --max-ci US       confidence interval to reach before setting (%lld)\n",
+		max_ci / 1000);
+	fprintf(stderr, "  -w, --max-width US    only keep edges bracketed within it (any)\n");
+	fprintf(stderr, "  -k, --set-samples N   sets used to measure the set delay (%d)\n",
+		set_samples);
+	fprintf(stderr, "  -T, --tolerance US    offset to reach when setting the RTC (%lld)\n",
+		set_tolerance / 1000);
+	fprintf(stderr, "  -j, --low-jitter      pin to a CPU, lock memory and spin before setting\n");
+	fprintf(stderr, "  -P, --cpu CPU         CPU used in low jitter mode (current)\n");
+	fprintf(stderr, "                        one allowed CPU per RTC from there, wrapping around\n");
+	fprintf(stderr, "  -g, --guard US        time spent spinning in low jitter mode (%lld)\n",
+		spin_guard / 1000);
+	fprintf(stderr, "  -n, --read-samples N  reads used to measure the read latency (%d)\n",
+		read_samples);
+	fprintf(stderr, "  -l, --log FILE        log every sample to a ring file\n");
+	fprintf(stderr, "  -N, --log-size N      records kept by a new ring file (%llu)\n",
+		(unsigned long long)log_capacity);
+	fprintf(stderr, "  -x, --export FILE     print the samples of a ring file and exit\n");
+	fprintf(stderr, "  -F, --format FORMAT   csv or json lines, for --export (csv)\n");
+	fprintf(stderr, "  -L, --latency         only print the read latency histogram as JSON\n");
+	fprintf(stderr, "exits with 2 when the RTCs were set but --max-ci or --tolerance was not reached\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "daemon", no_argument, NULL, 'd' },
+		{ "publish", no_argument, NULL, 'p' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "step", required_argument, NULL, 's' },
+		{ "span", required_argument, NULL, 'S' },
+		{ "method", required_argument, NULL, 'm' },
+		{ "state", required_argument, NULL, 'c' },
+		{ "max-age", required_argument, NULL, 'a' },
+		{ "recalibrate", no_argument, NULL, 'R' },
+		{ "edges", required_argument, NULL, 'e' },
+		{ "max-ci", required_argument, NULL, 'C' },
+		{ "max-width", required_argument, NULL, 'w' },
+		{ "set-samples", required_argument, NULL, 'k' },
+		{ "tolerance", required_argument, NULL, 'T' },
+		{ "low-jitter", no_argument, NULL, 'j' },
+		{ "cpu", required_argument, NULL, 'P' },
+		{ "guard", required_argument, NULL, 'g' },
+		{ "read-samples", required_argument, NULL, 'n' },
+		{ "log", required_argument, NULL, 'l' },
+		{ "log-size", required_argument, NULL, 'N' },
+		{ "export", required_argument, NULL, 'x' },
+		{ "format", required_argument, NULL, 'F' },
+		{ "latency", no_argument, NULL, 'L' },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0 }
+	};
+	const char *method = "alarm";
+	const char *export_file = NULL;
+	const char *format = "csv";
+	const struct method *m = NULL;
+	struct rtc_dev dev;
+	struct timespec ts;
+	int epfd;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "dpi:s:S:m:c:a:Re:C:w:k:T:jP:g:n:l:N:x:F:Lh", options, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			daemonize = 1;
+			break;
+		case 'p':
+			publish = 1;
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			step_threshold = strtoll(optarg, NULL, 0) * 1000000;
+			break;
+		case 'S':
+			drift_span = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			method = optarg;
+			break;
+		case 'c':
+			state_file = optarg;
+			break;
+		case 'a':
+			max_age = strtoll(optarg, NULL, 0);
+			break;
+		case 'R':
+			recalibrate = 1;
+			break;
+		case 'e':
+			edge_samples = strtol(optarg, NULL, 0);
+			break;
+		case 'C':
+			max_ci = strtoll(optarg, NULL, 0) * 1000;
+			break;
+		case 'w':
+			max_width = strtoll(optarg, NULL, 0) * 1000;
+			break;
+		case 'k':
+			set_samples = strtol(optarg, NULL, 0);
+			break;
+		case 'T':
+			set_tolerance = strtoll(optarg, NULL, 0) * 1000;
+			break;
+		case 'j':
+			low_jitter = 1;
+			break;
+		case 'P':
+			cpu = strtol(optarg, NULL, 0);
+			break;
+		case 'g':
+			spin_guard = strtoll(optarg, NULL, 0) * 1000;
+			break;
+		case 'n':
+			read_samples = strtol(optarg, NULL, 0);
+			break;
+		case 'l':
+			log_file = optarg;
+			break;
+		case 'N':
+			log_capacity = strtoull(optarg, NULL, 0);
+			break;
+		case 'x':
+			export_file = optarg;
+			break;
+		case 'F':
+			format = optarg;
+			break;
+		case 'L':
+			latency_only = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (strcmp(method, "auto"))
+		m = find_method(method);
+
+	if ((daemonize && argc - optind > 1) || (publish && !daemonize) ||
+	    !interval || read_samples <= 0 ||
+	    edge_samples < 2 || edge_samples > MAX_EDGE_SAMPLES ||
+	    set_samples <= 0 || set_samples > MAX_SET_SAMPLES ||
+	    spin_guard < 0 || spin_guard >= NSEC_PER_SEC || !log_capacity ||
+	    (strcmp(format, "csv") && strcmp(format, "json")) ||
+	    (!m && strcmp(method, "auto"))) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (export_file)
+		return log_export(export_file, !strcmp(format, "json"));
+
+	if (optind < argc)
+		rtc_file = argv[optind];
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return 1;
+	}
+
+	if (latency_only) {
+		struct latency_hist hist;
+
+		if (dev_open(&dev, rtc_file, 0, epfd))
+			return 1;
+
+		set_realtime_priority();
+
+		if (read_latency(&hist, &dev))
+			return 1;
+
+		hist_print_json(&hist, "read_latency_ns", 1);
+
+		return 0;
+	}
+
+	clock_getres(CLOCK_REALTIME, &ts);
+	printf("CLOCK_REALTIME %lld.%09ld\n", (long long)ts.tv_sec, ts.tv_nsec);
+	clock_getres(CLOCK_MONOTONIC, &ts);
+	printf("CLOCK_MONOTONIC %lld.%09ld\n", (long long)ts.tv_sec, ts.tv_nsec);
+
+	if (log_file && log_open(log_file, 1))
+		return 1;
+
+	if (argc - optind > 1)
+		return exit_code(sync_rtcs(argv + optind, argc - optind, m));
+
+	if (dev_open(&dev, rtc_file, 0, epfd))
+		return 1;
+
+	set_realtime_priority();
+
+	if (low_jitter && set_low_jitter(&dev, cpu))
+		return 1;
+
+	if (m && !method_supported(&dev, m)) {
+		printf("%s not supported\n", m->name);
+		m = NULL;
+	}
+
+	if (!m) {
+		m = pick_method(&dev);
+		if (!m)
+			return 1;
+	}
+	printf("Using %s\n", m->name);
+	dev.method = m;
+
+	if (daemonize) {
+		if (publish && shm_create())
+			return 1;
+		return exit_code(discipline(&dev));
+	}
+
+	return exit_code(sync_rtc(&dev));
 }
@@ -7,18 +7,26 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
 #include <linux/const.h>
 #include <linux/rtc.h>
 #include <linux/types.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "rtc-snapshot.h"
+
 static char *rtc_file = "/dev/rtc0";
 
 #ifndef RTC_VL_DATA_INVALID
@@ -63,11 +71,12 @@ struct rtc_param {
 
 #endif
 
-#define IOCTL(f, r, d, rc) rc = ioctl(f, r, d); \
+#define IOCTL(file, f, r, d, rc) rc = ioctl(f, r, d); \
 if (rc) { \
-	fprintf(stderr, "%s returned %s (%d) at line %d\n", #r, \
-		strerror(errno), errno, __LINE__); \
-	exit(errno); \
+	rc = errno; \
+	fprintf(stderr, "%s: %s returned %s (%d) at line %d\n", file, #r, \
+		strerror(rc), rc, __LINE__); \
+	return -rc; \
 }
 
 #define ISODATEFMT "%04d-%02d-%02dT%02d:%02d:%02d"
@@ -116,9 +125,24 @@ static __attribute__ ((noreturn)) void usage(char *name)
 	fprintf(stderr, "       %s vlclr [rtc]\n", name);
 	fprintf(stderr, "       %s paramget param index [rtc]\n", name);
 	fprintf(stderr, "       %s paramset param index value [rtc]\n", name);
+	fprintf(stderr, "       %s info [rtc]\n", name);
+	fprintf(stderr, "       %s batch [-k] [file]\n", name);
+	fprintf(stderr, "       %s monitor uie|aie|pie[,...] [count] [rtc]\n", name);
+	fprintf(stderr, "       %s piebench [-f freq,...] [-t secs] [-l threads] [rtc]\n", name);
 	fprintf(stderr, "         Valid parameters:\n");
 	for (i = 0; i < ARRAY_SIZE(param_names); i++)
 		fprintf(stderr, "         - %s\n", param_names[i]);
+	fprintf(stderr, "         info prints all the parameters and the status of the RTC and\n");
+	fprintf(stderr, "         saves them in " RTC_SNAPSHOT_DIR " for the other tools, to be run\n");
+	fprintf(stderr, "         again whenever the device is registered again\n");
+	fprintf(stderr, "         rtc can be a comma separated list of devices or patterns such as\n");
+	fprintf(stderr, "         '/dev/rtc*', the command then runs on all of them in parallel\n");
+	fprintf(stderr, "         monitor enables the interrupts and prints their events until\n");
+	fprintf(stderr, "         count of them have been seen or until interrupted\n");
+	fprintf(stderr, "         piebench measures the periodic interrupt jitter at each frequency,\n");
+	fprintf(stderr, "         idle and then with threads keeping CPUs busy\n");
+	fprintf(stderr, "         batch runs the commands of file, or of the standard input,\n");
+	fprintf(stderr, "         one per line, and stops at the first error unless -k is given\n");
 
 	exit(EINVAL);
 }
@@ -163,182 +187,1154 @@ static int parse_rtc_param(struct rtc_param *param, char *param_name, char *inde
 	return 0;
 }
 
-int main(int argc, char **argv)
-{
+/* Not an ioctl, info issues several of them */
+#define RTC_CMD_INFO	(~0UL)
+
+/* A command parsed from the command line or from a batch line */
+struct rtc_cmd {
+	unsigned long cmd;
+	char *file;
 	struct rtc_time tm;
 	struct rtc_wkalrm alm;
 	struct rtc_param param;
-	int fd, rc;
-	unsigned int i, flags;
-	unsigned long cmd = 0;
+};
 
-	if (argc < 2)
-		usage(argv[0]);
+static int parse_date(char *date, struct rtc_time *tm)
+{
+	if (sscanf(date, "%d-%d-%dT%d:%d:%d", &tm->tm_year, &tm->tm_mon,
+		   &tm->tm_mday, &tm->tm_hour, &tm->tm_min, &tm->tm_sec) != 6)
+		return -EINVAL;
 
-	if (!strcmp(argv[1], "rd")) {
-		if (argc > 2)
-			rtc_file = argv[2];
-		cmd = RTC_RD_TIME;
-	} else if (!strcmp(argv[1], "set")) {
-		if (argc < 3)
-			usage(argv[0]);
-		if (argc > 3)
-			rtc_file = argv[3];
-		cmd = RTC_SET_TIME;
-		rc = sscanf(argv[2], "%d-%d-%dT%d:%d:%d", &tm.tm_year,
-			    &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
-			    &tm.tm_sec);
-		tm.tm_year -= 1900;
-		tm.tm_mon -= 1;
-	} else if (!strcmp(argv[1], "wkalmrd")) {
-		if (argc > 2)
-			rtc_file = argv[2];
-		cmd = RTC_WKALM_RD;
-	} else if (!strcmp(argv[1], "wkalmset")) {
-		if (argc < 3)
-			usage(argv[0]);
-		if (argc > 3)
-			rtc_file = argv[3];
-		cmd = RTC_WKALM_SET;
-		rc = sscanf(argv[2], "%d-%d-%dT%d:%d:%d", &alm.time.tm_year,
-			    &alm.time.tm_mon, &alm.time.tm_mday,
-			    &alm.time.tm_hour, &alm.time.tm_min,
-			    &alm.time.tm_sec);
-		alm.time.tm_year -= 1900;
-		alm.time.tm_mon -= 1;
-		alm.enabled = 1;
-	} else if (!strcmp(argv[1], "aieon")) {
+	tm->tm_year -= 1900;
+	tm->tm_mon -= 1;
+
+	return 0;
+}
+
+/*
+ * Parse a command, argv[0] being its name, e.g. "rd" or "paramget". Return
+ * -EINVAL when the command or its arguments are invalid.
+ */
+static int parse_command(struct rtc_cmd *c, int argc, char **argv)
+{
+	memset(c, 0, sizeof(*c));
+	c->file = rtc_file;
+
+	if (argc < 1)
+		return -EINVAL;
+
+	if (!strcmp(argv[0], "rd")) {
+		if (argc > 1)
+			c->file = argv[1];
+		c->cmd = RTC_RD_TIME;
+	} else if (!strcmp(argv[0], "set")) {
+		if (argc < 2)
+			return -EINVAL;
 		if (argc > 2)
-			rtc_file = argv[2];
-		cmd = RTC_AIE_ON;
-	} else if (!strcmp(argv[1], "aieoff")) {
+			c->file = argv[2];
+		c->cmd = RTC_SET_TIME;
+		if (parse_date(argv[1], &c->tm) < 0)
+			return -EINVAL;
+	} else if (!strcmp(argv[0], "wkalmrd")) {
+		if (argc > 1)
+			c->file = argv[1];
+		c->cmd = RTC_WKALM_RD;
+	} else if (!strcmp(argv[0], "wkalmset")) {
+		if (argc < 2)
+			return -EINVAL;
 		if (argc > 2)
-			rtc_file = argv[2];
-		cmd = RTC_AIE_OFF;
-	} else if (!strcmp(argv[1], "almread")) {
+			c->file = argv[2];
+		c->cmd = RTC_WKALM_SET;
+		if (parse_date(argv[1], &c->alm.time) < 0)
+			return -EINVAL;
+		c->alm.enabled = 1;
+	} else if (!strcmp(argv[0], "aieon")) {
+		if (argc > 1)
+			c->file = argv[1];
+		c->cmd = RTC_AIE_ON;
+	} else if (!strcmp(argv[0], "aieoff")) {
+		if (argc > 1)
+			c->file = argv[1];
+		c->cmd = RTC_AIE_OFF;
+	} else if (!strcmp(argv[0], "almread")) {
+		if (argc > 1)
+			c->file = argv[1];
+		c->cmd = RTC_ALM_READ;
+	} else if (!strcmp(argv[0], "almset")) {
+		if (argc < 2)
+			return -EINVAL;
 		if (argc > 2)
-			rtc_file = argv[2];
-		cmd = RTC_ALM_READ;
-	} else if (!strcmp(argv[1], "almset")) {
+			c->file = argv[2];
+		c->cmd = RTC_ALM_SET;
+		if (parse_date(argv[1], &c->tm) < 0)
+			return -EINVAL;
+	} else if (!strcmp(argv[0], "vlrd")) {
+		if (argc > 1)
+			c->file = argv[1];
+		c->cmd = RTC_VL_READ;
+	} else if (!strcmp(argv[0], "vlclr")) {
+		if (argc > 1)
+			c->file = argv[1];
+		c->cmd = RTC_VL_CLR;
+	} else if (!strcmp(argv[0], "info")) {
+		if (argc > 1)
+			c->file = argv[1];
+		c->cmd = RTC_CMD_INFO;
+	} else if (!strcmp(argv[0], "paramget")) {
 		if (argc < 3)
-			usage(argv[0]);
+			return -EINVAL;
 		if (argc > 3)
-			rtc_file = argv[3];
-		cmd = RTC_ALM_SET;
-		rc = sscanf(argv[2], "%d-%d-%dT%d:%d:%d", &tm.tm_year,
-			    &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
-			    &tm.tm_sec);
-		alm.time.tm_year -= 1900;
-		alm.time.tm_mon -= 1;
-		alm.enabled = 1;
-	} else if (!strcmp(argv[1], "vlrd")) {
-		if (argc > 2)
-			rtc_file = argv[2];
-		cmd = RTC_VL_READ;
-	} else if (!strcmp(argv[1], "vlclr")) {
-		if (argc > 2)
-			rtc_file = argv[2];
-		cmd = RTC_VL_CLR;
-	} else if (!strcmp(argv[1], "paramget")) {
+			c->file = argv[3];
+		c->cmd = RTC_PARAM_GET;
 
+		if (parse_rtc_param(&c->param, argv[1], argv[2], NULL) < 0)
+			return -EINVAL;
+	} else if (!strcmp(argv[0], "paramset")) {
 		if (argc < 4)
-			usage(argv[0]);
+			return -EINVAL;
 		if (argc > 4)
-			rtc_file = argv[4];
-		cmd = RTC_PARAM_GET;
+			c->file = argv[4];
+		c->cmd = RTC_PARAM_SET;
 
-		if (parse_rtc_param(&param, argv[2], argv[3], NULL) < 0)
-			usage(argv[0]);
+		if (parse_rtc_param(&c->param, argv[1], argv[2], argv[3]) < 0)
+			return -EINVAL;
+	}
 
-	} else if (!strcmp(argv[1], "paramset")) {
-		if (argc < 5)
-			usage(argv[0]);
-		if (argc > 5)
-			rtc_file = argv[5];
-		cmd = RTC_PARAM_SET;
+	return c->cmd ? 0 : -EINVAL;
+}
 
-		if (parse_rtc_param(&param, argv[2], argv[3], argv[4]) < 0)
-			usage(argv[0]);
+static void print_param(FILE *out, struct rtc_param *param)
+{
+	unsigned int i;
+
+	switch(param->param) {
+	case RTC_PARAM_FEATURES:
+		fprintf(out, "%s[%u]:\n", param_names[param->param], param->index);
+		for (i = 0; i < ARRAY_SIZE(feature_names); i++)
+			if (param->uvalue & _BITUL(i))
+				fprintf(out, "	%s\n", feature_names[i]);
+		break;
+	case RTC_PARAM_CORRECTION:
+		fprintf(out, "%s[%u] = %lld\n", param_names[param->param],
+			param->index, param->svalue);
+		break;
+	case RTC_PARAM_BACKUP_SWITCH_MODE:
+		if (param->uvalue < ARRAY_SIZE(bsm_names)) {
+			fprintf(out, "%s[%u] = %s\n", param_names[param->param],
+				param->index, bsm_names[param->uvalue]);
+			break;
+		}
+		/* fall through */
+	default:
+		fprintf(out, "%s[%u] = %llx\n", param_names[param->param],
+			param->index, param->uvalue);
 	}
+}
 
-	if (!cmd)
-		usage(argv[0]);
+static long long rtc_time_secs(const struct rtc_time *rtm)
+{
+	struct tm tm = {
+		.tm_sec = rtm->tm_sec,
+		.tm_min = rtm->tm_min,
+		.tm_hour = rtm->tm_hour,
+		.tm_mday = rtm->tm_mday,
+		.tm_mon = rtm->tm_mon,
+		.tm_year = rtm->tm_year,
+	};
 
-	fd = open(rtc_file, O_RDONLY);
-	if (fd ==  -1) {
-		perror(rtc_file);
-		exit(errno);
+	return timegm(&tm);
+}
+
+static void snapshot_ioctl(int fd, unsigned long req, void *arg,
+			   struct rtc_snapshot_value *v)
+{
+	v->error = ioctl(fd, req, arg) ? errno : 0;
+}
+
+static int snapshot_save(const char *file, const struct rtc_snapshot *snap)
+{
+	char path[PATH_MAX + 16], tmp[PATH_MAX + 32];
+	FILE *f;
+
+	if (mkdir(RTC_SNAPSHOT_DIR, 0755) && errno != EEXIST) {
+		perror(RTC_SNAPSHOT_DIR);
+		return -errno;
 	}
 
-	switch (cmd) {
+	rtc_snapshot_path(path, sizeof(path), file);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return -errno;
+	}
+
+	if (fwrite(snap, sizeof(*snap), 1, f) != 1 || fclose(f) ||
+	    rename(tmp, path)) {
+		perror(path);
+		unlink(tmp);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Read the parameters of every index, the time, the alarm and the voltage
+ * status in one go, print them and save them as the snapshot of the RTC. An
+ * index is only printed when it has at least one parameter. Failing to save
+ * the snapshot is only warned about.
+ */
+static int rtc_info(struct rtc_cmd *c, int fd, FILE *out)
+{
+	struct rtc_snapshot snap = {
+		.magic = RTC_SNAPSHOT_MAGIC,
+		.version = RTC_SNAPSHOT_VERSION,
+		.taken = time(NULL),
+	};
+	struct rtc_snapshot_value *v;
+	struct rtc_param param;
+	unsigned int i, j, found;
+	unsigned int flags;
+
+	for (i = 0; i < RTC_SNAPSHOT_INDEXES; i++) {
+		for (j = 0, found = 0; j < RTC_SNAPSHOT_PARAMS; j++) {
+			v = &snap.params[i][j];
+			memset(&param, 0, sizeof(param));
+			param.param = j;
+			param.index = i;
+			snapshot_ioctl(fd, RTC_PARAM_GET, &param, v);
+			v->value = param.svalue;
+			found |= !v->error;
+		}
+
+		for (j = 0; j < RTC_SNAPSHOT_PARAMS && (found || !i); j++) {
+			v = &snap.params[i][j];
+			if (!v->error) {
+				param.param = j;
+				param.index = i;
+				param.svalue = v->value;
+				print_param(out, &param);
+			} else if (found) {
+				fprintf(out, "%s[%u]: %s\n", param_names[j], i,
+					strerror(v->error));
+			}
+		}
+	}
+	if (snap.params[0][RTC_PARAM_FEATURES].error)
+		fprintf(out, "%s: features unknown (%s)\n", c->file,
+			strerror(snap.params[0][RTC_PARAM_FEATURES].error));
+
+	snapshot_ioctl(fd, RTC_RD_TIME, &c->tm, &snap.time);
+	if (!snap.time.error) {
+		snap.time.value = rtc_time_secs(&c->tm);
+		fprintf(out, "%s: " ISODATEFMT "\n", c->file, ISODATE(c->tm));
+	} else {
+		fprintf(out, "%s: time: %s\n", c->file, strerror(snap.time.error));
+	}
+
+	snapshot_ioctl(fd, RTC_WKALM_RD, &c->alm, &snap.alarm);
+	if (!snap.alarm.error) {
+		snap.alarm.value = rtc_time_secs(&c->alm.time);
+		snap.alarm_enabled = c->alm.enabled;
+		snap.alarm_pending = c->alm.pending;
+		fprintf(out, "%s: alarm " ISODATEFMT "%s%s\n", c->file,
+			ISODATE(c->alm.time), c->alm.enabled ? " enabled" : "",
+			c->alm.pending ? " pending" : "");
+	} else {
+		fprintf(out, "%s: alarm: %s\n", c->file,
+			strerror(snap.alarm.error));
+	}
+
+	snapshot_ioctl(fd, RTC_VL_READ, &flags, &snap.vl);
+	if (!snap.vl.error) {
+		snap.vl.value = flags;
+		fprintf(out, "%s: voltage low flags: %x\n", c->file, flags);
+	} else {
+		fprintf(out, "%s: voltage: %s\n", c->file,
+			strerror(snap.vl.error));
+	}
+
+	/* Everything was printed, only the other tools miss the snapshot */
+	if (snapshot_save(c->file, &snap))
+		fprintf(stderr, "%s: warning: snapshot not saved\n", c->file);
+
+	return 0;
+}
+
+/* Run a parsed command on fd, printing the results to out */
+static int exec_command(struct rtc_cmd *c, int fd, FILE *out)
+{
+	unsigned int flags;
+	int rc;
+
+	switch (c->cmd) {
 	case RTC_RD_TIME:
-		IOCTL(fd, RTC_RD_TIME, &tm, rc);
-		printf("%s: " ISODATEFMT "\n", rtc_file, ISODATE(tm));
+		IOCTL(c->file, fd, RTC_RD_TIME, &c->tm, rc);
+		fprintf(out, "%s: " ISODATEFMT "\n", c->file, ISODATE(c->tm));
 		break;
 	case RTC_SET_TIME:
-		IOCTL(fd, RTC_SET_TIME, &tm, rc);
+		IOCTL(c->file, fd, RTC_SET_TIME, &c->tm, rc);
 		break;
 	case RTC_WKALM_RD:
-		IOCTL(fd, RTC_WKALM_RD, &alm, rc);
-		printf("%s: " ISODATEFMT "\n", rtc_file, ISODATE(alm.time));
+		IOCTL(c->file, fd, RTC_WKALM_RD, &c->alm, rc);
+		fprintf(out, "%s: " ISODATEFMT "\n", c->file,
+			ISODATE(c->alm.time));
 		break;
 	case RTC_WKALM_SET:
-		IOCTL(fd, RTC_WKALM_SET, &alm, rc);
+		IOCTL(c->file, fd, RTC_WKALM_SET, &c->alm, rc);
 		break;
 	case RTC_ALM_READ:
-		IOCTL(fd, RTC_ALM_READ, &tm, rc);
-		printf("%s: " ISODATEFMT "\n", rtc_file, ISODATE(tm));
+		IOCTL(c->file, fd, RTC_ALM_READ, &c->tm, rc);
+		fprintf(out, "%s: " ISODATEFMT "\n", c->file, ISODATE(c->tm));
 		break;
 	case RTC_ALM_SET:
-		IOCTL(fd, RTC_ALM_SET, &tm, rc);
+		IOCTL(c->file, fd, RTC_ALM_SET, &c->tm, rc);
 		break;
 	case RTC_AIE_ON:
-		IOCTL(fd, RTC_AIE_ON, 0, rc);
+		IOCTL(c->file, fd, RTC_AIE_ON, 0, rc);
 		break;
 	case RTC_AIE_OFF:
-		IOCTL(fd, RTC_AIE_OFF, 0, rc);
+		IOCTL(c->file, fd, RTC_AIE_OFF, 0, rc);
 		break;
 	case RTC_VL_READ:
-		IOCTL(fd, RTC_VL_READ, &flags, rc);
-		printf("%s: voltage low flags: %x\n", rtc_file, flags);
+		IOCTL(c->file, fd, RTC_VL_READ, &flags, rc);
+		fprintf(out, "%s: voltage low flags: %x\n", c->file, flags);
 		if (flags & RTC_VL_DATA_INVALID)
-			printf("Voltage too low, RTC data is invalid\n");
+			fprintf(out, "Voltage too low, RTC data is invalid\n");
 		if (flags & RTC_VL_BACKUP_LOW)
-			printf("Backup voltage is low\n");
+			fprintf(out, "Backup voltage is low\n");
 		if (flags & RTC_VL_BACKUP_EMPTY)
-			printf("Backup empty or not present\n");
+			fprintf(out, "Backup empty or not present\n");
 		if (flags & RTC_VL_ACCURACY_LOW)
-			printf("Voltage is low, RTC accuracy is reduced\n");
+			fprintf(out, "Voltage is low, RTC accuracy is reduced\n");
 		if (flags & RTC_VL_BACKUP_SWITCH)
-			printf("Backup switchover happened\n");
+			fprintf(out, "Backup switchover happened\n");
 		break;
 	case RTC_VL_CLR:
-		IOCTL(fd, RTC_VL_CLR, 0, rc);
+		IOCTL(c->file, fd, RTC_VL_CLR, 0, rc);
 		break;
 	case RTC_PARAM_SET:
-		IOCTL(fd, RTC_PARAM_SET, &param, rc);
+		IOCTL(c->file, fd, RTC_PARAM_SET, &c->param, rc);
 		break;
 	case RTC_PARAM_GET:
-		IOCTL(fd, RTC_PARAM_GET, &param, rc);
-		switch(param.param) {
-		case RTC_PARAM_FEATURES:
-			printf("%s[%u]:\n", param_names[param.param], param.index);
-			for (i = 0; i < ARRAY_SIZE(feature_names); i++)
-				if (param.uvalue & _BITUL(i))
-					printf("	%s\n", feature_names[i]);
+		IOCTL(c->file, fd, RTC_PARAM_GET, &c->param, rc);
+		print_param(out, &c->param);
+		break;
+	case RTC_CMD_INFO:
+		return rtc_info(c, fd, out);
+	}
+
+	return 0;
+}
+
+/* One device of a command run on several of them */
+struct rtc_job {
+	struct rtc_cmd c;
+	pthread_t thread;
+	char *buf;		/* output of the command */
+	size_t len;
+	int started;
+	int rc;
+};
+
+static void *run_job(void *arg)
+{
+	struct rtc_job *job = arg;
+	FILE *out;
+	int fd;
+
+	out = open_memstream(&job->buf, &job->len);
+	if (!out) {
+		job->rc = -errno;
+		return NULL;
+	}
+
+	fd = open(job->c.file, O_RDONLY);
+	if (fd == -1) {
+		job->rc = -errno;
+		perror(job->c.file);
+	} else {
+		job->rc = exec_command(&job->c, fd, out);
+		close(fd);
+	}
+
+	fclose(out);
+
+	return NULL;
+}
+
+/* Print the output of a device, tagging the lines that do not name it */
+static void print_job(struct rtc_job *job)
+{
+	size_t n = strlen(job->c.file);
+	char *line, *next;
+
+	for (line = job->buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		if (strncmp(line, job->c.file, n) || line[n] != ':')
+			printf("%s: ", job->c.file);
+		printf("%s\n", line);
+	}
+}
+
+/* Whether rtc names several devices, through a list or a pattern */
+static int is_rtc_list(const char *rtc)
+{
+	return strpbrk(rtc, ",*?[") != NULL;
+}
+
+/*
+ * Drop the paths naming a device already in g, e.g. /dev/rtc next to the
+ * /dev/rtc0 it links to. An RTC can only be opened once at a time, so the
+ * second open would fail with EBUSY.
+ */
+static void dedup_rtcs(glob_t *g)
+{
+	dev_t *rdevs;
+	struct stat st;
+	size_t i, j, n;
+
+	rdevs = calloc(g->gl_pathc, sizeof(*rdevs));
+	if (!rdevs)
+		return;
+
+	for (i = 0, n = 0; i < g->gl_pathc; i++) {
+		/* Keep what cannot be stat'ed, its open reports it */
+		if (!stat(g->gl_pathv[i], &st) && S_ISCHR(st.st_mode)) {
+			for (j = 0; j < i; j++)
+				if (rdevs[j] == st.st_rdev)
+					break;
+			if (j < i) {
+				free(g->gl_pathv[i]);
+				continue;
+			}
+			rdevs[i] = st.st_rdev;
+		}
+		g->gl_pathv[n++] = g->gl_pathv[i];
+	}
+
+	g->gl_pathc = n;
+	g->gl_pathv[n] = NULL;
+	free(rdevs);
+}
+
+/* Expand a comma separated list of devices and patterns into g */
+static int expand_rtcs(char *list, glob_t *g)
+{
+	char *pattern, *save;
+	int flags = 0;
+
+	for (pattern = strtok_r(list, ",", &save); pattern;
+	     pattern = strtok_r(NULL, ",", &save)) {
+		/* Keep what matches nothing so that its open reports it */
+		if (glob(pattern, flags | GLOB_NOCHECK, NULL, g)) {
+			fprintf(stderr, "%s: invalid pattern\n", pattern);
+			if (flags)
+				globfree(g);
+			return -EINVAL;
+		}
+		flags = GLOB_APPEND;
+	}
+
+	if (!flags)
+		return -EINVAL;
+
+	dedup_rtcs(g);
+
+	return 0;
+}
+
+/*
+ * Run the command on every device of its comma separated list of devices and
+ * patterns, in parallel. The outputs are printed in the order of the list,
+ * once all the devices are done, and the first error is returned.
+ */
+static int run_fanout(struct rtc_cmd *c)
+{
+	struct rtc_job *jobs;
+	int rc = 0;
+	glob_t g;
+	size_t i;
+
+	rc = expand_rtcs(c->file, &g);
+	if (rc)
+		return rc;
+
+	jobs = calloc(g.gl_pathc, sizeof(*jobs));
+	if (!jobs) {
+		globfree(&g);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < g.gl_pathc; i++) {
+		jobs[i].c = *c;
+		jobs[i].c.file = g.gl_pathv[i];
+		jobs[i].started = !pthread_create(&jobs[i].thread, NULL,
+						  run_job, &jobs[i]);
+	}
+
+	for (i = 0; i < g.gl_pathc; i++) {
+		/* Out of threads, run it now */
+		if (!jobs[i].started)
+			run_job(&jobs[i]);
+		else
+			pthread_join(jobs[i].thread, NULL);
+
+		print_job(&jobs[i]);
+		free(jobs[i].buf);
+		if (jobs[i].rc && !rc)
+			rc = jobs[i].rc;
+	}
+
+	free(jobs);
+	globfree(&g);
+
+	return rc;
+}
+
+#define MAX_OPEN_RTCS	16	/* devices kept open by a batch */
+#define MAX_BATCH_ARGS	8	/* words of a batch line */
+
+/* The devices used by a batch, opened once and kept open until its end */
+static struct {
+	char *file;
+	dev_t rdev;
+	int fd;
+} open_rtcs[MAX_OPEN_RTCS];
+static unsigned int nr_open_rtcs;
+
+/* Under whichever name, a device can only be opened once */
+static int rtc_open(const char *file)
+{
+	struct stat st;
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < nr_open_rtcs; i++)
+		if (!strcmp(open_rtcs[i].file, file))
+			return open_rtcs[i].fd;
+
+	if (!stat(file, &st) && S_ISCHR(st.st_mode))
+		for (i = 0; i < nr_open_rtcs; i++)
+			if (open_rtcs[i].rdev == st.st_rdev)
+				return open_rtcs[i].fd;
+
+	if (nr_open_rtcs == MAX_OPEN_RTCS) {
+		fprintf(stderr, "%s: more than %d devices\n", file,
+			MAX_OPEN_RTCS);
+		return -EMFILE;
+	}
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1) {
+		perror(file);
+		return -errno;
+	}
+
+	if (fstat(fd, &st) || !S_ISCHR(st.st_mode))
+		st.st_rdev = 0;
+
+	open_rtcs[nr_open_rtcs].file = strdup(file);
+	open_rtcs[nr_open_rtcs].rdev = st.st_rdev;
+	open_rtcs[nr_open_rtcs].fd = fd;
+	nr_open_rtcs++;
+
+	return fd;
+}
+
+static void rtc_close_all(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_open_rtcs; i++) {
+		close(open_rtcs[i].fd);
+		free(open_rtcs[i].file);
+	}
+	nr_open_rtcs = 0;
+}
+
+/*
+ * Run the commands of f, one per line, with the same syntax as on the command
+ * line. Empty lines and lines starting with # are skipped. Stop at the first
+ * error unless keep_going is set, return the first error.
+ */
+static int run_batch(FILE *f, const char *name, int keep_going)
+{
+	char *line = NULL, *argv[MAX_BATCH_ARGS + 1];
+	int argc, fd, rc, ret = 0;
+	unsigned int lineno = 0;
+	struct rtc_cmd c;
+	size_t len = 0;
+
+	while (getline(&line, &len, f) > 0) {
+		lineno++;
+
+		argc = 0;
+		argv[argc] = strtok(line, " \t\n");
+		while (argv[argc] && argc < MAX_BATCH_ARGS)
+			argv[++argc] = strtok(NULL, " \t\n");
+
+		if (!argc || argv[0][0] == '#')
+			continue;
+
+		rc = parse_command(&c, argc, argv);
+		if (rc < 0 || argv[argc]) {
+			fprintf(stderr, "%s:%u: invalid command\n", name, lineno);
+			rc = -EINVAL;
+		} else if (is_rtc_list(c.file)) {
+			/*
+			 * Not through the open devices, each job opens its
+			 * own. Close them first, the jobs would get EBUSY on
+			 * them.
+			 */
+			rtc_close_all();
+			rc = run_fanout(&c);
+		} else {
+			fd = rtc_open(c.file);
+			rc = fd < 0 ? fd : exec_command(&c, fd, stdout);
+		}
+
+		if (rc < 0 && !ret)
+			ret = rc;
+		if (rc < 0 && !keep_going)
 			break;
-		case RTC_PARAM_CORRECTION:
-			printf("%s[%u] = %lld\n", param_names[param.param], param.index, param.svalue);
+	}
+
+	free(line);
+	rtc_close_all();
+
+	return ret;
+}
+
+#define MONITOR_BUF_SIZE	65536	/* events buffered while more are pending */
+#define MONITOR_EVENTS		16	/* events handled per wakeup */
+
+/* Interrupt sources of the monitor */
+static const struct {
+	const char *name;
+	unsigned long on, off;
+} irq_sources[] = {
+	{ "uie", RTC_UIE_ON, RTC_UIE_OFF },
+	{ "aie", RTC_AIE_ON, RTC_AIE_OFF },
+	{ "pie", RTC_PIE_ON, RTC_PIE_OFF },
+};
+
+/* A device watched by the monitor */
+struct rtc_monitor {
+	char *file;
+	int fd;
+	unsigned int enabled;	/* irq_sources turned on, by bit */
+	unsigned long events;	/* reads */
+	unsigned long irqs;	/* interrupts, as counted by the driver */
+};
+
+static volatile sig_atomic_t monitor_stop;
+
+static void monitor_signal(int sig __attribute__ ((unused)))
+{
+	monitor_stop = 1;
+}
+
+/* Parse a comma separated list of interrupt sources, e.g. "uie,aie" */
+static int parse_irq_sources(char *list, unsigned int *sources)
+{
+	char *name, *save;
+	unsigned int i;
+
+	*sources = 0;
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < ARRAY_SIZE(irq_sources); i++)
+			if (!strcmp(name, irq_sources[i].name))
+				break;
+
+		if (i == ARRAY_SIZE(irq_sources))
+			return -EINVAL;
+
+		*sources |= 1 << i;
+	}
+
+	return *sources ? 0 : -EINVAL;
+}
+
+static int monitor_enable(struct rtc_monitor *m, unsigned int sources)
+{
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < ARRAY_SIZE(irq_sources); i++) {
+		if (!(sources & (1 << i)))
+			continue;
+
+		if (ioctl(m->fd, irq_sources[i].on, 0)) {
+			rc = errno;
+			fprintf(stderr, "%s: enabling %s returned %s (%d)\n",
+				m->file, irq_sources[i].name, strerror(rc), rc);
+			return -rc;
+		}
+		m->enabled |= 1 << i;
+	}
+
+	return 0;
+}
+
+static void monitor_disable(struct rtc_monitor *m)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(irq_sources); i++)
+		if ((m->enabled & (1 << i)) &&
+		    ioctl(m->fd, irq_sources[i].off, 0))
+			fprintf(stderr, "%s: disabling %s returned %s (%d)\n",
+				m->file, irq_sources[i].name, strerror(errno),
+				errno);
+	m->enabled = 0;
+}
+
+/* The low byte of the data holds the interrupt flags, the rest the count */
+static void print_event(struct rtc_monitor *m, unsigned long data,
+			const struct timespec *ts)
+{
+	printf("%lld.%09ld %s:", (long long)ts->tv_sec, ts->tv_nsec, m->file);
+	if (data & RTC_UF)
+		printf(" UF");
+	if (data & RTC_AF)
+		printf(" AF");
+	if (data & RTC_PF)
+		printf(" PF");
+	printf(" count %lu\n", data >> 8);
+}
+
+/*
+ * Enable the interrupt sources on every device of the list and print their
+ * events, timestamped with CLOCK_MONOTONIC when the wait returned, until count
+ * events have been seen or until interrupted. The output is only flushed when
+ * no event is pending, so that bursts do not cost a write each.
+ */
+static int run_monitor(char *list, unsigned int sources, unsigned long count)
+{
+	struct epoll_event ev[MONITOR_EVENTS];
+	struct sigaction sa = { .sa_handler = monitor_signal };
+	unsigned long data, events = 0;
+	struct rtc_monitor *mons, *m;
+	struct timespec ts;
+	int epfd, n, rc, live;
+	ssize_t len;
+	glob_t g;
+	size_t i;
+
+	rc = expand_rtcs(list, &g);
+	if (rc)
+		return rc;
+
+	/* Nothing is open yet, whatever fails below */
+	mons = calloc(g.gl_pathc, sizeof(*mons));
+	for (i = 0; mons && i < g.gl_pathc; i++)
+		mons[i].fd = -1;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (!mons || epfd < 0) {
+		rc = mons ? -errno : -ENOMEM;
+		perror("monitor");
+		goto out;
+	}
+
+	for (i = 0; i < g.gl_pathc; i++) {
+		struct epoll_event add = { .events = EPOLLIN };
+
+		m = &mons[i];
+		m->file = g.gl_pathv[i];
+		m->fd = open(m->file, O_RDONLY | O_NONBLOCK);
+		if (m->fd == -1) {
+			rc = -errno;
+			perror(m->file);
+			goto out;
+		}
+
+		add.data.ptr = m;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, m->fd, &add)) {
+			rc = -errno;
+			perror(m->file);
+			goto out;
+		}
+
+		rc = monitor_enable(m, sources);
+		if (rc)
+			goto out;
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	setvbuf(stdout, NULL, _IOFBF, MONITOR_BUF_SIZE);
+
+	/* Stop once every device is gone, nothing would wake the wait up */
+	live = g.gl_pathc;
+	while (!monitor_stop && live && (!count || events < count)) {
+		n = epoll_wait(epfd, ev, ARRAY_SIZE(ev), 0);
+		if (!n) {
+			fflush(stdout);
+			n = epoll_wait(epfd, ev, ARRAY_SIZE(ev), -1);
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			rc = -errno;
+			perror("epoll_wait");
 			break;
-		case RTC_PARAM_BACKUP_SWITCH_MODE:
-			printf("%s[%u] = %s\n", param_names[param.param], param.index, bsm_names[param.uvalue]);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		for (i = 0; i < (size_t)n && (!count || events < count); i++) {
+			m = ev[i].data.ptr;
+			len = read(m->fd, &data, sizeof(data));
+			if (len < 0 && errno == EAGAIN)
+				continue;
+			if (len != sizeof(data)) {
+				/* Gone, stop watching it */
+				fprintf(stderr, "%s: no more events\n", m->file);
+				epoll_ctl(epfd, EPOLL_CTL_DEL, m->fd, NULL);
+				live--;
+				continue;
+			}
+
+			m->events++;
+			m->irqs += data >> 8;
+			events++;
+			print_event(m, data, &ts);
+		}
+	}
+
+out:
+	for (i = 0; mons && i < g.gl_pathc; i++) {
+		m = &mons[i];
+		if (m->fd == -1)
+			continue;
+
+		monitor_disable(m);
+		close(m->fd);
+		if (!rc)
+			printf("%s: %lu events, %lu interrupts\n", m->file,
+			       m->events, m->irqs);
+	}
+	fflush(stdout);
+
+	if (epfd >= 0)
+		close(epfd);
+	free(mons);
+	globfree(&g);
+
+	return rc;
+}
+
+#define PIE_MAX_FREQ	8192	/* highest frequency of the default sweep */
+#define PIE_DURATION	2	/* seconds measured per frequency */
+#define PIE_TIMEOUT_MS	1000	/* beyond the period, the interrupts stopped */
+
+static int load_stop;
+
+/* Keep a CPU busy until load_stop is set */
+static void *load_thread(void *arg __attribute__ ((unused)))
+{
+	volatile unsigned long n = 0;
+
+	while (!__atomic_load_n(&load_stop, __ATOMIC_RELAXED))
+		n++;
+
+	return NULL;
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Measure the periodic interrupt at freq for secs seconds and print the
+ * percentiles of how far each interrupt came from its expected time. When the
+ * driver counts several interrupts for a read, the others were missed and the
+ * interval is compared to as many periods.
+ */
+static int pie_measure(int fd, const char *file, unsigned long freq,
+		       unsigned int secs, const char *load)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	long long period = 1000000000LL / freq, prev = 0, now, *jitter;
+	size_t i = 0, n = freq * secs;
+	unsigned long data, missed = 0;
+	struct timespec ts;
+	int rc = 0;
+
+	if (ioctl(fd, RTC_IRQP_SET, freq)) {
+		rc = errno;
+		if (rc != EINVAL && rc != EACCES) {
+			fprintf(stderr, "%s: RTC_IRQP_SET returned %s (%d)\n",
+				file, strerror(rc), rc);
+			return -rc;
+		}
+
+		printf("%-6s %6lu %s\n", load, freq, strerror(rc));
+		return 0;
+	}
+
+	jitter = malloc(n * sizeof(*jitter));
+	if (!jitter)
+		return -ENOMEM;
+
+	/* Drop an interrupt left over by the previous frequency */
+	while (poll(&pfd, 1, 0) > 0 && read(fd, &data, sizeof(data)) > 0)
+		;
+
+	if (ioctl(fd, RTC_PIE_ON, 0)) {
+		rc = errno;
+		fprintf(stderr, "%s: RTC_PIE_ON returned %s (%d)\n", file,
+			strerror(rc), rc);
+		free(jitter);
+		return -rc;
+	}
+
+	while (i < n) {
+		rc = poll(&pfd, 1, period / 1000000 + PIE_TIMEOUT_MS);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			rc = rc ? -errno : -ETIMEDOUT;
+			fprintf(stderr, "%s: no interrupt at %luHz: %s\n", file,
+				freq, strerror(-rc));
 			break;
-		default:
-			printf("%s[%u] = %llx\n", param_names[param.param], param.index, param.uvalue);
+		}
+
+		if (read(fd, &data, sizeof(data)) != sizeof(data)) {
+			rc = -errno;
+			perror(file);
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		rc = 0;
+
+		/* The first interrupt only starts the measurement */
+		if (prev) {
+			missed += (data >> 8) - 1;
+			jitter[i++] = llabs(now - prev -
+					    period * (long long)(data >> 8));
+		}
+		prev = now;
+	}
+
+	if (ioctl(fd, RTC_PIE_OFF, 0))
+		perror("RTC_PIE_OFF");
+
+	if (!rc) {
+		qsort(jitter, n, sizeof(*jitter), compare_ll);
+		printf("%-6s %6lu %8zu %7lu %9lld %9lld %9lld %9lld %9lld\n",
+		       load, freq, n, missed, jitter[n / 2],
+		       jitter[n * 90 / 100], jitter[n * 99 / 100],
+		       jitter[n * 999 / 1000], jitter[n - 1]);
+	} else if (rc == -ETIMEDOUT) {
+		/* The interrupts stopped at that frequency, try the next one */
+		printf("%-6s %6lu %s\n", load, freq, strerror(-rc));
+		rc = 0;
+	}
+
+	free(jitter);
+
+	return rc;
+}
+
+/*
+ * Sweep the periodic interrupt frequencies, idle and then with load threads
+ * spinning. freqs is a comma separated list, NULL for the powers of two up to
+ * PIE_MAX_FREQ. Frequencies the RTC or the user may not use, or at which the
+ * interrupts stop, are reported and skipped.
+ */
+static int run_piebench(const char *file, char *freqs, unsigned int secs,
+			unsigned int load)
+{
+	unsigned long freq, orig_freq;
+	pthread_t *threads = NULL;
+	unsigned int i, started;
+	char label[16], *list, *f, *save;
+	int fd, rc = 0, pass;
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1) {
+		perror(file);
+		return -errno;
+	}
+
+	if (ioctl(fd, RTC_IRQP_READ, &orig_freq)) {
+		rc = errno;
+		fprintf(stderr, "%s: RTC_IRQP_READ returned %s (%d)\n", file,
+			strerror(rc), rc);
+		close(fd);
+		return -rc;
+	}
+
+	if (load) {
+		threads = calloc(load, sizeof(*threads));
+		if (!threads) {
+			close(fd);
+			return -ENOMEM;
 		}
 	}
 
+	printf("%s: jitter in ns, %us per frequency\n", file, secs);
+	printf("%-6s %6s %8s %7s %9s %9s %9s %9s %9s\n", "load", "Hz", "irqs",
+	       "missed", "p50", "p90", "p99", "p99.9", "max");
+
+	for (pass = 0; pass < (load ? 2 : 1) && !rc; pass++) {
+		started = 0;
+		if (pass) {
+			snprintf(label, sizeof(label), "%ucpu", load);
+			__atomic_store_n(&load_stop, 0, __ATOMIC_RELAXED);
+			for (i = 0; i < load; i++)
+				if (!pthread_create(&threads[i], NULL,
+						    load_thread, NULL))
+					threads[started++] = threads[i];
+		} else {
+			snprintf(label, sizeof(label), "idle");
+		}
+
+		if (freqs) {
+			/* Parse a copy, the list is swept on every pass */
+			list = strdup(freqs);
+			if (!list)
+				rc = -ENOMEM;
+			for (f = list ? strtok_r(list, ",", &save) : NULL;
+			     f && !rc;
+			     f = strtok_r(NULL, ",", &save)) {
+				freq = strtoul(f, NULL, 10);
+				if (!freq) {
+					fprintf(stderr, "%s: invalid frequency\n", f);
+					rc = -EINVAL;
+					break;
+				}
+				rc = pie_measure(fd, file, freq, secs, label);
+			}
+			free(list);
+		} else {
+			for (freq = 2; freq <= PIE_MAX_FREQ && !rc; freq *= 2)
+				rc = pie_measure(fd, file, freq, secs, label);
+		}
+
+		__atomic_store_n(&load_stop, 1, __ATOMIC_RELAXED);
+		for (i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+	}
+
+	if (ioctl(fd, RTC_IRQP_SET, orig_freq))
+		perror("RTC_IRQP_SET");
+
+	free(threads);
 	close(fd);
 
-	return 0;
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	int keep_going = 0, fd, rc;
+	char *name = argv[0];
+	unsigned int sources, secs = PIE_DURATION, load = 0;
+	char *batch = "-", *freqs = NULL;
+	unsigned long count = 0;
+	int opt;
+	struct rtc_cmd c;
+	FILE *f;
+
+	if (argc < 2)
+		usage(argv[0]);
+
+	if (!strcmp(argv[1], "batch")) {
+		argv += 2;
+		argc -= 2;
+		if (argc && !strcmp(argv[0], "-k")) {
+			keep_going = 1;
+			argv++;
+			argc--;
+		}
+		if (argc > 1)
+			usage(name);
+		if (argc)
+			batch = argv[0];
+
+		f = strcmp(batch, "-") ? fopen(batch, "r") : stdin;
+		if (!f) {
+			perror(batch);
+			exit(errno);
+		}
+
+		rc = run_batch(f, batch, keep_going);
+		if (f != stdin)
+			fclose(f);
+
+		return -rc;
+	}
+
+	if (!strcmp(argv[1], "monitor")) {
+		if (argc < 3 || parse_irq_sources(argv[2], &sources) < 0)
+			usage(name);
+		argv += 3;
+		argc -= 3;
+		if (argc && strspn(argv[0], "0123456789") == strlen(argv[0])) {
+			count = strtoul(argv[0], NULL, 10);
+			argv++;
+			argc--;
+		}
+		if (argc > 1)
+			usage(name);
+
+		return -run_monitor(argc ? argv[0] : rtc_file, sources, count);
+	}
+
+	if (!strcmp(argv[1], "piebench")) {
+		while ((opt = getopt(argc - 1, argv + 1, "f:t:l:")) != -1) {
+			switch (opt) {
+			case 'f':
+				freqs = optarg;
+				break;
+			case 't':
+				secs = strtoul(optarg, NULL, 10);
+				break;
+			case 'l':
+				load = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage(name);
+			}
+		}
+		argv += optind + 1;
+		argc -= optind + 1;
+		if (argc > 1 || !secs)
+			usage(name);
+
+		return -run_piebench(argc ? argv[0] : rtc_file, freqs, secs,
+				     load);
+	}
+
+	if (parse_command(&c, argc - 1, argv + 1) < 0)
+		usage(argv[0]);
+
+	if (is_rtc_list(c.file))
+		return -run_fanout(&c);
+
+	fd = open(c.file, O_RDONLY);
+	if (fd ==  -1) {
+		perror(c.file);
+		exit(errno);
+	}
+
+	rc = exec_command(&c, fd, stdout);
+
+	close(fd);
+
+	return -rc;
 }